@@ -0,0 +1,455 @@
+/*
+ * calibration.c
+ *
+ *  Description: Calibration of the raw sensor data. Applies the calibration coefficients
+ *               and the temperature compensation to the queued records and averages the
+ *               enabled sensors.
+ */
+
+#include <float.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "imu.h"
+#include "main.h"
+#include "calibration.h"
+#include "util.h"
+
+// Two banks of coefficients so a new set can be uploaded over I2C while the active
+// bank stays in use. 'cc' always points to the active bank. The last NUM_GROUPS entries
+// are the averaged coefficients of each mounting group, used by the group calibration.
+struct CalibrationCoefficients ccBank[2][NUM_CAL_SETS];
+struct CalibrationCoefficients *cc = ccBank[0];
+struct CalibrationTable calTables[2];
+struct CalibrationTable *calTable = &calTables[0];
+struct TemperatureCompensation tempComp;
+
+// Calibrated data samples of the individual sensors for each record in a batch, stored
+// axis-major (i.e. dataCal[record][axis][sensor]). Only filled in when per-sensor data is needed
+float dataCal[CAL_BATCH_SIZE][NUM_IMU_VALUES][NUM_SENSORS] = {0};
+// Calibrated temperature of sensors for each record in a batch
+float tempCal[CAL_BATCH_SIZE][NUM_SENSORS] = {0};
+// Calibrated data averaged across all sensors for each record in a batch
+float dataFused[CAL_BATCH_SIZE][NUM_IMU_VALUES] = {0};
+// Averaged temperature for each record in a batch
+float tempFused[CAL_BATCH_SIZE] = {0};
+
+void UpdateTemperatureCompensation(uint8_t i, int16_t temp) {
+
+	uint8_t j = 0;
+
+	// Find the table entries on either side of the temperature and the fractional
+	// distance between them (Q(TEMP_LUT_SHIFT) fixed point). These are the same for
+	// every axis and both tables.
+	int32_t x = (int32_t)temp - TEMP_LUT_MIN;
+	if(x < 0) {
+		x = 0;
+	}
+	int32_t idx = x >> TEMP_LUT_SHIFT;
+	int32_t frac = x & ((1 << TEMP_LUT_SHIFT) - 1);
+	if(idx >= TEMP_LUT_POINTS - 1) {
+		idx = TEMP_LUT_POINTS - 2;
+		frac = (1 << TEMP_LUT_SHIFT);
+	}
+
+	// Calculate temperature deviation from 25 deg C
+	float dT = (K_T)*temp;
+
+	for(j = 0; j < NUM_IMU_VALUES; j++) {
+		// Linearly interpolate the tables
+		int32_t bias = cc[i].TB[j][idx] + (((cc[i].TB[j][idx + 1] - cc[i].TB[j][idx]) * frac) >> TEMP_LUT_SHIFT);
+		int32_t scale = cc[i].TS[j][idx] + (((cc[i].TS[j][idx + 1] - cc[i].TS[j][idx]) * frac) >> TEMP_LUT_SHIFT);
+
+		float k = (j < GX) ? K_A : K_G;
+		tempComp.scale[j][i] = k + k*scale*(1.0f / 32768.0f);
+		tempComp.offset[j][i] = calTable->b[j][i] + calTable->T[j][i]*dT + k*bias*(1.0f / 16.0f);
+		if(j >= GX) {
+			tempComp.offset[j][i] += GetGyroBiasCorrection(j - GX, i);
+		}
+	}
+
+	tempComp.temp[i] = temp;
+}
+
+void UpdateDecimatedTemperatureCompensation(void) {
+
+	uint8_t i = 0;
+
+	// Only update the sensors and groups that were calibrated since the last update, and
+	// only if their temperature moved by TEMP_COMP_HYSTERESIS or more, so a steady
+	// temperature costs no table interpolation. For a temperature ramp of R deg C/s and an
+	// update period of P seconds, the averaged temperature lags the actual temperature by
+	// at most 1.5*R*P, so the offset error is bounded by (1.5*R*P + 0.049 deg C) times
+	// the temperature coefficient of the sensor.
+	for(i = 0; i < NUM_CAL_SETS; i++) {
+		if(tempComp.tempCount[i] > 0) {
+			int16_t temp = tempComp.tempSum[i] / (int32_t)tempComp.tempCount[i];
+			int32_t change = (int32_t)temp - tempComp.temp[i];
+			if((change >= TEMP_COMP_HYSTERESIS) || (change <= -TEMP_COMP_HYSTERESIS)) {
+				UpdateTemperatureCompensation(i, temp);
+			}
+			tempComp.tempSum[i] = 0;
+			tempComp.tempCount[i] = 0;
+		}
+	}
+	tempComp.samples = 0;
+}
+
+uint8_t CalibrateAndAverageData(uint16_t k, uint16_t n, bool storeSensorData, bool weighted) {
+
+	uint8_t i = 0;
+	uint16_t j, r = 0;
+	uint8_t count = 0;
+	uint32_t enable = GetIMUEnableVector();
+
+	// Running (weighted) sums of the calibrated data and raw temperature for each record in the batch
+	float sum[CAL_BATCH_SIZE][NUM_IMU_VALUES] = {{0}};
+	int32_t tempSum[CAL_BATCH_SIZE] = {0};
+	// Fusion weight of the current sensor and sum of the weights of all enabled sensors
+	float wt[NUM_IMU_VALUES] = {1, 1, 1, 1, 1, 1};
+	float weightSum[NUM_IMU_VALUES] = {0};
+
+	// Temporary arrays to store intermediate calculations
+	float tmp[3] = {0};
+	float a[3] = {0};
+	float w[3] = {0};
+	// Coefficients of the sensor currently being calibrated
+	float sc[6], off[6], G[9], A_ISM[9], G_ISM[9];
+
+	// Calibrate each sensor individually
+	for(i = 0; i < NUM_SENSORS; i++, enable >>= 1) {
+		// Check to see if this sensor is enabled
+		if(enable & 0x01) {
+			count++;
+
+			// Load the coefficients for this sensor once and use them for every record in the batch
+			for(j = 0; j < 6; j++) {
+				sc[j] = tempComp.scale[j][i];
+				off[j] = tempComp.offset[j][i];
+				if(weighted) {
+					wt[j] = fusionWeight[j][i];
+				}
+				weightSum[j] += wt[j];
+			}
+			for(j = 0; j < 9; j++) {
+				G[j] = calTable->G[j][i];
+				A_ISM[j] = calTable->A_ISM[j][i];
+				G_ISM[j] = calTable->G_ISM[j][i];
+			}
+
+			r = k;
+			for(j = 0; j < n; j++) {
+				volatile int16_t *data = queue[r].sensor[i].data;
+
+				// Collect the temperature for the next update of the temperature compensation
+				tempSum[j] += data[TEMP];
+				tempComp.tempSum[i] += data[TEMP];
+				tempComp.tempCount[i]++;
+
+				// Calculate true specific force
+				// a_true = (K_a)*a-meas - bias - temp bias
+				tmp[X] = sc[AX]*data[AX] - off[AX];
+				tmp[Y] = sc[AY]*data[AY] - off[AY];
+				tmp[Z] = sc[AZ]*data[AZ] - off[AZ];
+
+				// Multiply by inverse of accelerometer misalignment/scale factor matrix
+				a[X] = A_ISM[0]*tmp[X] + A_ISM[1]*tmp[Y] + A_ISM[2]*tmp[Z];
+				a[Y] = A_ISM[3]*tmp[X] + A_ISM[4]*tmp[Y] + A_ISM[5]*tmp[Z];
+				a[Z] = A_ISM[6]*tmp[X] + A_ISM[7]*tmp[Y] + A_ISM[8]*tmp[Z];
+
+				// Calculate true angular rate
+				// w_true = (K_g)*w_meas - bias - temp bias - g-sensitivity
+				tmp[X] = sc[GX]*data[GX] - off[GX] - G[0]*a[X] - G[1]*a[Y] - G[2]*a[Z];
+				tmp[Y] = sc[GY]*data[GY] - off[GY] - G[3]*a[X] - G[4]*a[Y] - G[5]*a[Z];
+				tmp[Z] = sc[GZ]*data[GZ] - off[GZ] - G[6]*a[X] - G[7]*a[Y] - G[8]*a[Z];
+
+				// Multiply by inverse of gyroscope misalignment/scale factor matrix
+				w[X] = G_ISM[0]*tmp[X] + G_ISM[1]*tmp[Y] + G_ISM[2]*tmp[Z];
+				w[Y] = G_ISM[3]*tmp[X] + G_ISM[4]*tmp[Y] + G_ISM[5]*tmp[Z];
+				w[Z] = G_ISM[6]*tmp[X] + G_ISM[7]*tmp[Y] + G_ISM[8]*tmp[Z];
+
+				// Accumulate calibrated data straight into the sums
+				sum[j][AX] += wt[AX]*a[X];
+				sum[j][AY] += wt[AY]*a[Y];
+				sum[j][AZ] += wt[AZ]*a[Z];
+				sum[j][GX] += wt[GX]*w[X];
+				sum[j][GY] += wt[GY]*w[Y];
+				sum[j][GZ] += wt[GZ]*w[Z];
+
+				// Only keep the individual sensor data if someone needs it
+				if(storeSensorData) {
+					dataCal[j][AX][i] = a[X];
+					dataCal[j][AY][i] = a[Y];
+					dataCal[j][AZ][i] = a[Z];
+					dataCal[j][GX][i] = w[X];
+					dataCal[j][GY][i] = w[Y];
+					dataCal[j][GZ][i] = w[Z];
+					tempCal[j][i] = (K_T)*data[TEMP] + 25;
+				}
+
+				// Move to the next record, wrapping around the end of the queue
+				if(++r >= QUEUE_SIZE) {
+					r = 0;
+				}
+			}
+		}
+		// Disabled sensors sort to the end of the per-sensor data
+		else if(storeSensorData) {
+			for(j = 0; j < n; j++) {
+				dataCal[j][AX][i] = FLT_MAX;
+				dataCal[j][AY][i] = FLT_MAX;
+				dataCal[j][AZ][i] = FLT_MAX;
+				dataCal[j][GX][i] = FLT_MAX;
+				dataCal[j][GY][i] = FLT_MAX;
+				dataCal[j][GZ][i] = FLT_MAX;
+			}
+		}
+	}
+
+	// Avoid dividing by zero if every sensor has been disabled
+	for(j = 0; j < NUM_IMU_VALUES; j++) {
+		if(weightSum[j] <= 0) {
+			weightSum[j] = 1;
+		}
+	}
+
+	// Divide once per record, converting degrees to radians and g's to m/s^2 at the same time
+	float scale[NUM_IMU_VALUES];
+	for(j = 0; j < NUM_IMU_VALUES; j++) {
+		scale[j] = ((j < GX) ? GRAVITY : DEG_TO_RAD) / weightSum[j];
+	}
+	float tempScale = K_T / (float)((count > 0) ? count : 1);
+	for(j = 0; j < n; j++) {
+		dataFused[j][AX] = sum[j][AX]*scale[AX];
+		dataFused[j][AY] = sum[j][AY]*scale[AY];
+		dataFused[j][AZ] = sum[j][AZ]*scale[AZ];
+		dataFused[j][GX] = sum[j][GX]*scale[GX];
+		dataFused[j][GY] = sum[j][GY]*scale[GY];
+		dataFused[j][GZ] = sum[j][GZ]*scale[GZ];
+		tempFused[j] = tempSum[j]*tempScale + 25;
+	}
+
+	return count;
+}
+
+uint8_t CalibrateGroupSums(uint16_t k, uint16_t n) {
+
+	uint8_t g, i, s = 0;
+	uint16_t j, r = 0;
+	uint8_t count = 0;
+	uint32_t enable = GetIMUEnableVector();
+
+	// Running sums of the calibrated data and raw temperature for each record in the batch
+	float sum[CAL_BATCH_SIZE][NUM_IMU_VALUES] = {{0}};
+	int32_t tempSum[CAL_BATCH_SIZE] = {0};
+
+	// Temporary arrays to store intermediate calculations
+	float raw[NUM_IMU_VALUES] = {0};
+	float tmp[3] = {0};
+	float a[3] = {0};
+	float w[3] = {0};
+	// Coefficients of the group currently being calibrated
+	float sc[6], off[6], G[9], A_ISM[9], G_ISM[9];
+
+	for(g = 0; g < NUM_GROUPS; g++, enable >>= GROUP_SIZE) {
+		// Sensors of this group that are enabled
+		uint32_t groupEnable = enable & ((1 << GROUP_SIZE) - 1);
+		uint8_t groupCount = 0;
+		for(i = 0; i < GROUP_SIZE; i++) {
+			if(groupEnable & (1 << i)) {
+				groupCount++;
+			}
+		}
+		if(groupCount == 0) {
+			continue;
+		}
+		count += groupCount;
+		i = NUM_SENSORS + g;
+
+		for(s = 0; s < 6; s++) {
+			sc[s] = tempComp.scale[s][i];
+			off[s] = tempComp.offset[s][i];
+		}
+		for(s = 0; s < 9; s++) {
+			G[s] = calTable->G[s][i];
+			A_ISM[s] = calTable->A_ISM[s][i];
+			G_ISM[s] = calTable->G_ISM[s][i];
+		}
+
+		r = k;
+		for(j = 0; j < n; j++) {
+			// Sum the raw counts of the group in integer arithmetic. The sensors of a group
+			// share the same orientation, so the counts of each axis line up.
+			int32_t rawSum[7] = {0};
+			volatile struct IMURawData *sensor = &queue[r].sensor[g*GROUP_SIZE];
+			for(s = 0; s < GROUP_SIZE; s++) {
+				if(groupEnable & (1 << s)) {
+					rawSum[AX] += sensor[s].data[AX];
+					rawSum[AY] += sensor[s].data[AY];
+					rawSum[AZ] += sensor[s].data[AZ];
+					rawSum[GX] += sensor[s].data[GX];
+					rawSum[GY] += sensor[s].data[GY];
+					rawSum[GZ] += sensor[s].data[GZ];
+					rawSum[TEMP] += sensor[s].data[TEMP];
+				}
+			}
+			tempSum[j] += rawSum[TEMP];
+
+			// Temperature compensation is done at the average temperature of the group
+			tempComp.tempSum[i] += rawSum[TEMP];
+			tempComp.tempCount[i] += groupCount;
+
+			// Average counts of the group
+			float invCount = 1.0f / groupCount;
+			for(s = 0; s < NUM_IMU_VALUES; s++) {
+				raw[s] = rawSum[s]*invCount;
+			}
+
+			// Same calibration as the individual sensors, using the averaged coefficients
+			tmp[X] = sc[AX]*raw[AX] - off[AX];
+			tmp[Y] = sc[AY]*raw[AY] - off[AY];
+			tmp[Z] = sc[AZ]*raw[AZ] - off[AZ];
+
+			a[X] = A_ISM[0]*tmp[X] + A_ISM[1]*tmp[Y] + A_ISM[2]*tmp[Z];
+			a[Y] = A_ISM[3]*tmp[X] + A_ISM[4]*tmp[Y] + A_ISM[5]*tmp[Z];
+			a[Z] = A_ISM[6]*tmp[X] + A_ISM[7]*tmp[Y] + A_ISM[8]*tmp[Z];
+
+			tmp[X] = sc[GX]*raw[GX] - off[GX] - G[0]*a[X] - G[1]*a[Y] - G[2]*a[Z];
+			tmp[Y] = sc[GY]*raw[GY] - off[GY] - G[3]*a[X] - G[4]*a[Y] - G[5]*a[Z];
+			tmp[Z] = sc[GZ]*raw[GZ] - off[GZ] - G[6]*a[X] - G[7]*a[Y] - G[8]*a[Z];
+
+			w[X] = G_ISM[0]*tmp[X] + G_ISM[1]*tmp[Y] + G_ISM[2]*tmp[Z];
+			w[Y] = G_ISM[3]*tmp[X] + G_ISM[4]*tmp[Y] + G_ISM[5]*tmp[Z];
+			w[Z] = G_ISM[6]*tmp[X] + G_ISM[7]*tmp[Y] + G_ISM[8]*tmp[Z];
+
+			// Weight each group by its number of sensors so the result is the mean of all
+			// enabled sensors
+			sum[j][AX] += groupCount*a[X];
+			sum[j][AY] += groupCount*a[Y];
+			sum[j][AZ] += groupCount*a[Z];
+			sum[j][GX] += groupCount*w[X];
+			sum[j][GY] += groupCount*w[Y];
+			sum[j][GZ] += groupCount*w[Z];
+
+			// Move to the next record, wrapping around the end of the queue
+			if(++r >= QUEUE_SIZE) {
+				r = 0;
+			}
+		}
+	}
+
+	// Divide once per record, converting degrees to radians and g's to m/s^2 at the same time
+	float invCount = 1.0f / (float)((count > 0) ? count : 1);
+	float accScale = GRAVITY*invCount;
+	float gyroScale = DEG_TO_RAD*invCount;
+	for(j = 0; j < n; j++) {
+		dataFused[j][AX] = sum[j][AX]*accScale;
+		dataFused[j][AY] = sum[j][AY]*accScale;
+		dataFused[j][AZ] = sum[j][AZ]*accScale;
+		dataFused[j][GX] = sum[j][GX]*gyroScale;
+		dataFused[j][GY] = sum[j][GY]*gyroScale;
+		dataFused[j][GZ] = sum[j][GZ]*gyroScale;
+		tempFused[j] = tempSum[j]*K_T*invCount + 25;
+	}
+
+	return count;
+}
+
+#ifdef PROFILE_TWO_STAGE_CAL
+// Calibrated data and temperature averaged by the two-stage path, only kept for the comparison
+float dataTwoStage[CAL_BATCH_SIZE][NUM_IMU_VALUES] = {0};
+float tempTwoStage[CAL_BATCH_SIZE] = {0};
+
+// First stage of the processing used before the calibration and averaging were fused:
+// calibrate each enabled sensor into dataCal
+void CalibrateData(uint16_t k, uint16_t n) {
+
+	uint8_t i = 0;
+	uint16_t j, r = 0;
+
+	// Temporary array to store intermediate calculations
+	float tmp[3] = {0};
+	// Coefficients of the sensor currently being calibrated
+	float sc[6], off[6], G[9], A_ISM[9], G_ISM[9];
+
+	for(i = 0; i < NUM_SENSORS; i++) {
+		// Check to see if this sensor is enabled
+		if(IsIMUEnabled(i)) {
+			for(j = 0; j < 6; j++) {
+				sc[j] = tempComp.scale[j][i];
+				off[j] = tempComp.offset[j][i];
+			}
+			for(j = 0; j < 9; j++) {
+				G[j] = calTable->G[j][i];
+				A_ISM[j] = calTable->A_ISM[j][i];
+				G_ISM[j] = calTable->G_ISM[j][i];
+			}
+
+			r = k;
+			for(j = 0; j < n; j++) {
+				volatile int16_t *data = queue[r].sensor[i].data;
+
+				tempCal[j][i] = (K_T)*data[TEMP] + 25;
+
+				tmp[X] = sc[AX]*data[AX] - off[AX];
+				tmp[Y] = sc[AY]*data[AY] - off[AY];
+				tmp[Z] = sc[AZ]*data[AZ] - off[AZ];
+
+				dataCal[j][AX][i] = A_ISM[0]*tmp[X] + A_ISM[1]*tmp[Y] + A_ISM[2]*tmp[Z];
+				dataCal[j][AY][i] = A_ISM[3]*tmp[X] + A_ISM[4]*tmp[Y] + A_ISM[5]*tmp[Z];
+				dataCal[j][AZ][i] = A_ISM[6]*tmp[X] + A_ISM[7]*tmp[Y] + A_ISM[8]*tmp[Z];
+
+				tmp[X] = sc[GX]*data[GX] - off[GX] - G[0]*dataCal[j][AX][i] - G[1]*dataCal[j][AY][i] - G[2]*dataCal[j][AZ][i];
+				tmp[Y] = sc[GY]*data[GY] - off[GY] - G[3]*dataCal[j][AX][i] - G[4]*dataCal[j][AY][i] - G[5]*dataCal[j][AZ][i];
+				tmp[Z] = sc[GZ]*data[GZ] - off[GZ] - G[6]*dataCal[j][AX][i] - G[7]*dataCal[j][AY][i] - G[8]*dataCal[j][AZ][i];
+
+				dataCal[j][GX][i] = G_ISM[0]*tmp[X] + G_ISM[1]*tmp[Y] + G_ISM[2]*tmp[Z];
+				dataCal[j][GY][i] = G_ISM[3]*tmp[X] + G_ISM[4]*tmp[Y] + G_ISM[5]*tmp[Z];
+				dataCal[j][GZ][i] = G_ISM[6]*tmp[X] + G_ISM[7]*tmp[Y] + G_ISM[8]*tmp[Z];
+
+				// Move to the next record, wrapping around the end of the queue
+				if(++r >= QUEUE_SIZE) {
+					r = 0;
+				}
+			}
+		}
+	}
+}
+
+// Second stage of the old processing: average the calibrated data of 'n' records across
+// all enabled sensors
+void AverageData(uint16_t n) {
+
+	uint8_t i, s = 0;
+	uint16_t j = 0;
+
+	for(j = 0; j < n; j++) {
+		for(i = 0; i < NUM_IMU_VALUES; i++) {
+			float sum = 0;
+			float tempSum = 0;
+			uint8_t count = 0;
+
+			// Average data across all sensors
+			for(s = 0; s < NUM_SENSORS; s++) {
+				// Check to see if this sensor is enabled
+				if(IsIMUEnabled(s)) {
+					sum += dataCal[j][i][s];
+					tempSum += tempCal[j][s];
+					count++;
+				}
+			}
+
+			dataTwoStage[j][i] = sum / (float)count;
+			tempTwoStage[j] = tempSum / (float)count;
+		}
+
+		// Convert g's to m/s^2 and degrees to radians
+		dataTwoStage[j][AX] *= GRAVITY;
+		dataTwoStage[j][AY] *= GRAVITY;
+		dataTwoStage[j][AZ] *= GRAVITY;
+		dataTwoStage[j][GX] *= DEG_TO_RAD;
+		dataTwoStage[j][GY] *= DEG_TO_RAD;
+		dataTwoStage[j][GZ] *= DEG_TO_RAD;
+	}
+}
+#endif
@@ -0,0 +1,125 @@
+/*
+ * calibration.h
+ *
+ *  Description: Calibration of the raw sensor data. Applies the calibration coefficients
+ *               and the temperature compensation to the queued records and averages the
+ *               enabled sensors. Relies on main.h and imu.h for the array sizes.
+ */
+
+#ifndef CALIBRATION_H_
+#define CALIBRATION_H_
+
+// Raw data for a single IMU
+struct IMURawData {
+	int16_t data[7];
+};
+// Raw data for multiple IMUs plus a time stamp
+struct RawDataQueue {
+	uint32_t timeStamp;
+	struct IMURawData sensor[NUM_SENSORS];
+};
+
+struct CalibrationCoefficients {
+	// Bias coefficients
+	float b[6];
+	// Scale factor coefficients
+	float S[6];
+	// Misalignment coefficients
+	float M[6];
+	// Temperature coefficients
+	float T[6];
+	// Gyro g-sensitivity coefficients
+	float G[9];
+	// Temperature compensation tables (see TEMP_LUT_* for the temperature of each entry)
+	// Bias in raw sensor counts, Q4 fixed point (1/16 count)
+	int16_t TB[6][TEMP_LUT_POINTS];
+	// Scale factor error, Q15 fixed point (raw value is multiplied by 1 + TS/32768)
+	int16_t TS[6][TEMP_LUT_POINTS];
+};
+
+// Calibration coefficients used by the calibration loop. Each coefficient is stored
+// axis-major (structure of arrays) so the coefficients of all sensors for a given axis
+// are contiguous in memory. Packed from 'cc' after the coefficients are loaded, double
+// buffered along with 'ccBank'.
+struct CalibrationTable {
+	// Bias coefficients
+	float b[NUM_IMU_VALUES][NUM_CAL_SETS];
+	// Temperature coefficients
+	float T[NUM_IMU_VALUES][NUM_CAL_SETS];
+	// Gyro g-sensitivity coefficients
+	float G[9][NUM_CAL_SETS];
+	// Accelerometer inverted scale factor/misalignment matrix
+	float A_ISM[9][NUM_CAL_SETS];
+	// Gyro inverted scale factor/misalignment matrix
+	float G_ISM[9][NUM_CAL_SETS];
+};
+
+// Temperature dependent part of the calibration. Combines the raw data conversion factor,
+// bias, linear temperature coefficient and temperature compensation tables so that
+//     (K * raw) - b - (T * dT) = (scale * raw) - offset
+// Temperature changes over seconds, so rather than following every (noisy) temperature
+// reading, the readings are averaged and the compensation is refreshed once every
+// REG_TEMP_CAL_DIV samples. The calibration loop only applies the cached scale and offset.
+struct TemperatureCompensation {
+	// Raw temperature reading the compensation was computed for
+	int16_t temp[NUM_CAL_SETS];
+	// Scale factor applied to the raw data
+	float scale[NUM_IMU_VALUES][NUM_CAL_SETS];
+	// Offset subtracted from the scaled data
+	float offset[NUM_IMU_VALUES][NUM_CAL_SETS];
+	// Sum and number of the raw temperature readings since the last update
+	int32_t tempSum[NUM_CAL_SETS];
+	uint32_t tempCount[NUM_CAL_SETS];
+	// Records processed since the last update
+	uint16_t samples;
+};
+
+// Queued raw data records (main.c)
+extern volatile struct RawDataQueue queue[QUEUE_SIZE];
+// Inverse-variance fusion weights of each sensor, axis-major (main.c)
+extern float fusionWeight[NUM_IMU_VALUES][NUM_SENSORS];
+
+// Coefficient banks, the active bank and the calibration tables packed from them
+extern struct CalibrationCoefficients ccBank[2][NUM_CAL_SETS];
+extern struct CalibrationCoefficients *cc;
+extern struct CalibrationTable calTables[2];
+extern struct CalibrationTable *calTable;
+extern struct TemperatureCompensation tempComp;
+
+// Calibrated data of the individual sensors (dataCal[record][axis][sensor]) and their
+// temperature, for each record in a batch. Only filled in when per-sensor data is needed.
+extern float dataCal[CAL_BATCH_SIZE][NUM_IMU_VALUES][NUM_SENSORS];
+extern float tempCal[CAL_BATCH_SIZE][NUM_SENSORS];
+// Calibrated data and temperature averaged across all sensors, for each record in a batch
+extern float dataFused[CAL_BATCH_SIZE][NUM_IMU_VALUES];
+extern float tempFused[CAL_BATCH_SIZE];
+
+// Recomputes the temperature compensation of sensor (or group) 'i' for the raw
+// temperature 'temp' from the tables of the active coefficient bank
+void UpdateTemperatureCompensation(uint8_t i, int16_t temp);
+
+// Recomputes the temperature compensation of the sensors and groups whose averaged
+// temperature since the last update moved by TEMP_COMP_HYSTERESIS or more
+void UpdateDecimatedTemperatureCompensation(void);
+
+// Calibrates the 'n' queued records starting at index 'k' and averages the enabled
+// sensors of each into dataFused and tempFused. The sensors are weighted by fusionWeight
+// if 'weighted' is true, equally otherwise. If 'storeSensorData' is true, the calibrated
+// data of each sensor is kept in dataCal and tempCal (disabled sensors as FLT_MAX).
+// Returns the number of enabled sensors.
+uint8_t CalibrateAndAverageData(uint16_t k, uint16_t n, bool storeSensorData, bool weighted);
+
+// Same as CalibrateAndAverageData, but averages the raw counts of each mounting group
+// and calibrates the group average once with the averaged coefficients of the group
+uint8_t CalibrateGroupSums(uint16_t k, uint16_t n);
+
+// Old two-stage path, only built with PROFILE_TWO_STAGE_CAL (util.h) for the cost
+// comparison. CalibrateData calibrates every enabled sensor of the 'n' queued records
+// starting at index 'k' into dataCal and tempCal, AverageData then averages them across
+// the enabled sensors into dataTwoStage and tempTwoStage.
+extern float dataTwoStage[CAL_BATCH_SIZE][NUM_IMU_VALUES];
+extern float tempTwoStage[CAL_BATCH_SIZE];
+void CalibrateData(uint16_t k, uint16_t n);
+void AverageData(uint16_t n);
+
+#endif /* CALIBRATION_H_ */
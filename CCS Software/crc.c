@@ -0,0 +1,33 @@
+/*
+ * crc.c
+ *
+ *  Description: CRC-32 used to validate data uploaded over I2C
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "crc.h"
+
+// CRC-32 (reflected polynomial 0xEDB88320) of each 4-bit value. Processing a nibble at a
+// time keeps the table at 64 bytes of flash instead of 1 kB for a byte-wise table.
+static const uint32_t crcTable[16] = {
+	0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+	0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+	0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+	0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+uint32_t CRC32(uint32_t crc, const char *data, uint32_t length) {
+
+	uint32_t i;
+
+	crc = ~crc;
+	for(i = 0; i < length; i++) {
+		crc ^= (uint8_t)data[i];
+		crc = (crc >> 4) ^ crcTable[crc & 0x0F];
+		crc = (crc >> 4) ^ crcTable[crc & 0x0F];
+	}
+
+	return ~crc;
+}
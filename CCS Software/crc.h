@@ -0,0 +1,15 @@
+/*
+ * crc.h
+ *
+ *  Description: CRC-32 used to validate data uploaded over I2C
+ */
+
+#ifndef CRC_H_
+#define CRC_H_
+
+// Updates the running CRC-32 'crc' with 'length' bytes of 'data' and returns the result.
+// Uses the same polynomial and conventions as zlib's crc32(), so start with crc = 0 and
+// pass the result back in to continue a CRC over several blocks of data.
+uint32_t CRC32(uint32_t crc, const char *data, uint32_t length);
+
+#endif /* CRC_H_ */
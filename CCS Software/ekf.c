@@ -0,0 +1,278 @@
+/*
+ * ekf.c
+ *
+ *  Description: Error-state Kalman filter for attitude and gyro bias. The 6 error
+ *               states are the attitude error (rad, body frame) and the gyro bias
+ *               error (rad/s). The filter is propagated with the delta thetas of each
+ *               attitude update and corrected with the direction of gravity measured
+ *               by the accelerometers.
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ekf.h"
+#include "registers.h"
+
+// The 6x6 covariance is kept as three 3x3 blocks (row-major)
+//     P = [ A   B ]    A: attitude error, B: cross terms, C: gyro bias
+//         [ B'  C ]
+// A and C are symmetric, so only their upper triangles are computed and then mirrored.
+struct EKFState {
+	// Nominal attitude quaternion (body to navigation frame, scalar first)
+	float q[4];
+	// Nominal gyro bias
+	float bias[3];
+	float A[9];
+	float B[9];
+	float C[9];
+	// Attitude updates since the last measurement update
+	uint32_t count;
+};
+struct EKFState ekf;
+
+struct EKFConfig ekfConfig = {EKF_GYRO_NOISE_DEFAULT, EKF_BIAS_NOISE_DEFAULT,
+		EKF_ACC_NOISE_DEFAULT, EKF_MEAS_DIV_DEFAULT};
+struct EKFOutput ekfOutput;
+
+// Copies the upper triangle of the symmetric 3x3 matrix 'm' to its lower triangle
+static void Mirror(float *m) {
+	m[3] = m[1];
+	m[6] = m[2];
+	m[7] = m[5];
+}
+
+// out = a * b
+static void Mul33(const float *a, const float *b, float *out) {
+	uint8_t i, j = 0;
+	for(i = 0; i < 3; i++) {
+		for(j = 0; j < 3; j++) {
+			out[3*i + j] = a[3*i]*b[j] + a[3*i + 1]*b[3 + j] + a[3*i + 2]*b[6 + j];
+		}
+	}
+}
+
+// Upper triangle of out = a * b', where the product is known to be symmetric
+static void MulTransSym33(const float *a, const float *b, float *out) {
+	uint8_t i, j = 0;
+	for(i = 0; i < 3; i++) {
+		for(j = i; j < 3; j++) {
+			out[3*i + j] = a[3*i]*b[3*j] + a[3*i + 1]*b[3*j + 1] + a[3*i + 2]*b[3*j + 2];
+		}
+	}
+}
+
+// out = a' * b
+static void TransMul33(const float *a, const float *b, float *out) {
+	uint8_t i, j = 0;
+	for(i = 0; i < 3; i++) {
+		for(j = 0; j < 3; j++) {
+			out[3*i + j] = a[i]*b[j] + a[3 + i]*b[3 + j] + a[6 + i]*b[6 + j];
+		}
+	}
+}
+
+// Multiplies the nominal attitude by the rotation vector 'r' and normalizes it
+static void Rotate(const float *r) {
+	float *q = ekf.q;
+	float phiSq = r[0]*r[0] + r[1]*r[1] + r[2]*r[2];
+	float d0 = 1 - 0.125f*phiSq;
+	float s = 0.5f - phiSq*(1.0f/48.0f);
+	float d1 = r[0]*s, d2 = r[1]*s, d3 = r[2]*s;
+
+	float q0 = q[0]*d0 - q[1]*d1 - q[2]*d2 - q[3]*d3;
+	float q1 = q[0]*d1 + q[1]*d0 + q[2]*d3 - q[3]*d2;
+	float q2 = q[0]*d2 - q[1]*d3 + q[2]*d0 + q[3]*d1;
+	float q3 = q[0]*d3 + q[1]*d2 - q[2]*d1 + q[3]*d0;
+
+	float k = 1 / sqrtf(q0*q0 + q1*q1 + q2*q2 + q3*q3);
+	q[0] = q0*k;
+	q[1] = q1*k;
+	q[2] = q2*k;
+	q[3] = q3*k;
+}
+
+static void Propagate(const float *dTheta, float dt) {
+
+	uint8_t i = 0;
+	float MA[9], MB[9];
+
+	// Remove the estimated bias and move the nominal attitude
+	float r[3] = {dTheta[0] - ekf.bias[0]*dt, dTheta[1] - ekf.bias[1]*dt, dTheta[2] - ekf.bias[2]*dt};
+	Rotate(r);
+
+	// Error state transition
+	//     Phi = [ M  -dt*I ]    M = I - [r x]
+	//           [ 0    I   ]
+	const float M[9] = {   1,  r[2], -r[1],
+	                   -r[2],     1,  r[0],
+	                    r[1], -r[0],     1};
+
+	// A = M*A*M' - dt*(M*B + (M*B)') + dt^2*C + Q_att
+	// B = M*B - dt*C
+	// C = C + Q_bias
+	Mul33(M, ekf.A, MA);
+	Mul33(M, ekf.B, MB);
+	MulTransSym33(MA, M, ekf.A);
+
+	float dt2 = dt*dt;
+	float qAtt = ekfConfig.gyroNoise*ekfConfig.gyroNoise*dt;
+	float qBias = ekfConfig.biasNoise*ekfConfig.biasNoise*dt;
+
+	ekf.A[0] += -2*dt*MB[0] + dt2*ekf.C[0] + qAtt;
+	ekf.A[1] += -dt*(MB[1] + MB[3]) + dt2*ekf.C[1];
+	ekf.A[2] += -dt*(MB[2] + MB[6]) + dt2*ekf.C[2];
+	ekf.A[4] += -2*dt*MB[4] + dt2*ekf.C[4] + qAtt;
+	ekf.A[5] += -dt*(MB[5] + MB[7]) + dt2*ekf.C[5];
+	ekf.A[8] += -2*dt*MB[8] + dt2*ekf.C[8] + qAtt;
+	Mirror(ekf.A);
+
+	for(i = 0; i < 9; i++) {
+		ekf.B[i] = MB[i] - dt*ekf.C[i];
+	}
+
+	ekf.C[0] += qBias;
+	ekf.C[4] += qBias;
+	ekf.C[8] += qBias;
+}
+
+static void UpdateGravity(const float *f, float g) {
+
+	uint8_t i = 0;
+	float *q = ekf.q;
+
+	// Only use the specific force as gravity when the body is not accelerating much
+	float fNorm = sqrtf(f[0]*f[0] + f[1]*f[1] + f[2]*f[2]);
+	if(fabsf(fNorm - g) >= EKF_ACC_GATE*g) {
+		return;
+	}
+
+	// Predicted direction of gravity (up) in the body frame and residual
+	float v[3];
+	v[0] = 2*(q[1]*q[3] - q[0]*q[2]);
+	v[1] = 2*(q[2]*q[3] + q[0]*q[1]);
+	v[2] = 1 - 2*(q[1]*q[1] + q[2]*q[2]);
+	float invNorm = 1 / fNorm;
+	float res[3] = {f[0]*invNorm - v[0], f[1]*invNorm - v[1], f[2]*invNorm - v[2]};
+
+	// Measurement matrix H = [ V  0 ] with V = [v x]
+	const float V[9] = {    0, -v[2],  v[1],
+	                     v[2],     0, -v[0],
+	                    -v[1],  v[0],     0};
+	float HA[9], HB[9], S[9], Si[9], KA[9], KB[9], T[9];
+
+	// S = V*A*V' + R
+	Mul33(V, ekf.A, HA);
+	Mul33(V, ekf.B, HB);
+	MulTransSym33(HA, V, S);
+	float R = ekfConfig.accNoise*ekfConfig.accNoise;
+	S[0] += R;
+	S[4] += R;
+	S[8] += R;
+
+	// Inverse of the symmetric S
+	Si[0] = S[4]*S[8] - S[5]*S[5];
+	Si[1] = S[2]*S[5] - S[1]*S[8];
+	Si[2] = S[1]*S[5] - S[2]*S[4];
+	Si[4] = S[0]*S[8] - S[2]*S[2];
+	Si[5] = S[1]*S[2] - S[0]*S[5];
+	Si[8] = S[0]*S[4] - S[1]*S[1];
+	float det = S[0]*Si[0] + S[1]*Si[1] + S[2]*Si[2];
+	if(det <= 0) {
+		return;
+	}
+	float invDet = 1 / det;
+	Si[0] *= invDet;
+	Si[1] *= invDet;
+	Si[2] *= invDet;
+	Si[4] *= invDet;
+	Si[5] *= invDet;
+	Si[8] *= invDet;
+	Mirror(Si);
+
+	// Gains K = P*H'*S^-1, split into the attitude (KA = (V*A)'*Si) and bias (KB = (V*B)'*Si) rows
+	TransMul33(HA, Si, KA);
+	TransMul33(HB, Si, KB);
+
+	// Covariance: A -= KA*V*A, B -= KA*V*B, C -= KB*V*B
+	Mul33(KA, HA, T);
+	ekf.A[0] -= T[0];
+	ekf.A[1] -= T[1];
+	ekf.A[2] -= T[2];
+	ekf.A[4] -= T[4];
+	ekf.A[5] -= T[5];
+	ekf.A[8] -= T[8];
+	Mirror(ekf.A);
+	Mul33(KA, HB, T);
+	for(i = 0; i < 9; i++) {
+		ekf.B[i] -= T[i];
+	}
+	Mul33(KB, HB, T);
+	ekf.C[0] -= T[0];
+	ekf.C[1] -= T[1];
+	ekf.C[2] -= T[2];
+	ekf.C[4] -= T[4];
+	ekf.C[5] -= T[5];
+	ekf.C[8] -= T[8];
+	Mirror(ekf.C);
+
+	// Move the estimated errors into the nominal state (the errors are then zero again)
+	float dAtt[3], dBias[3];
+	for(i = 0; i < 3; i++) {
+		dAtt[i] = KA[3*i]*res[0] + KA[3*i + 1]*res[1] + KA[3*i + 2]*res[2];
+		dBias[i] = KB[3*i]*res[0] + KB[3*i + 1]*res[1] + KB[3*i + 2]*res[2];
+	}
+	Rotate(dAtt);
+	ekf.bias[0] += dBias[0];
+	ekf.bias[1] += dBias[1];
+	ekf.bias[2] += dBias[2];
+}
+
+void EKFInitialize(void) {
+	RegMapPage(PAGE_EKF, &ekfOutput, sizeof(ekfOutput), false);
+	RegMapPage(PAGE_EKF_CFG, &ekfConfig, sizeof(ekfConfig), true);
+}
+
+void EKFReset(const float *q) {
+
+	uint8_t i = 0;
+
+	for(i = 0; i < 4; i++) {
+		ekf.q[i] = q[i];
+	}
+	for(i = 0; i < 9; i++) {
+		ekf.A[i] = 0;
+		ekf.B[i] = 0;
+		ekf.C[i] = 0;
+	}
+	for(i = 0; i < 3; i++) {
+		ekf.bias[i] = 0;
+		ekf.A[4*i] = EKF_ATT_SIGMA_INIT*EKF_ATT_SIGMA_INIT;
+		ekf.C[4*i] = EKF_BIAS_SIGMA_INIT*EKF_BIAS_SIGMA_INIT;
+	}
+	ekf.count = 0;
+}
+
+void EKFStep(const float *dTheta, float dt, const float *f, float g) {
+
+	uint8_t i = 0;
+
+	Propagate(dTheta, dt);
+
+	if(++ekf.count >= ekfConfig.measDiv) {
+		ekf.count = 0;
+		UpdateGravity(f, g);
+	}
+
+	// Publish the state
+	ekfOutput.q[0] = ekf.q[1];
+	ekfOutput.q[1] = ekf.q[2];
+	ekfOutput.q[2] = ekf.q[3];
+	ekfOutput.q[3] = ekf.q[0];
+	for(i = 0; i < 3; i++) {
+		ekfOutput.bias[i] = ekf.bias[i];
+		ekfOutput.varAtt[i] = ekf.A[4*i];
+		ekfOutput.varBias[i] = ekf.C[4*i];
+	}
+}
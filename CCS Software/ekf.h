@@ -0,0 +1,56 @@
+/*
+ * ekf.h
+ *
+ *  Description: Error-state Kalman filter for attitude and gyro bias. The 6 error
+ *               states are the attitude error (rad, body frame) and the gyro bias
+ *               error (rad/s). The filter is propagated with the delta thetas of each
+ *               attitude update and corrected with the direction of gravity measured
+ *               by the accelerometers.
+ */
+
+#ifndef EKF_H_
+#define EKF_H_
+
+// Default noise parameters
+#define EKF_GYRO_NOISE_DEFAULT      (1E-4f)		// Angle random walk, rad/sqrt(s)
+#define EKF_BIAS_NOISE_DEFAULT      (1E-5f)		// Bias random walk, rad/s/sqrt(s)
+#define EKF_ACC_NOISE_DEFAULT       (0.01f)		// Gravity direction noise (unit vector)
+#define EKF_MEAS_DIV_DEFAULT        (10)		// Attitude updates per measurement update
+// Initial standard deviations of the states
+#define EKF_ATT_SIGMA_INIT          (0.1f)		// rad
+#define EKF_BIAS_SIGMA_INIT         (0.01f)		// rad/s
+// Gravity measurements are skipped while the specific force is not within this
+// fraction of gravity
+#define EKF_ACC_GATE                (0.1f)
+
+// Filter settings, writable by the master through PAGE_EKF_CFG
+struct EKFConfig {
+	float gyroNoise;
+	float biasNoise;
+	float accNoise;
+	// Number of attitude updates between gravity measurement updates
+	uint32_t measDiv;
+};
+
+// Filter output, readable through PAGE_EKF
+struct EKFOutput {
+	// Attitude quaternion (X, Y, Z, W)
+	float q[4];
+	// Estimated gyro bias, rad/s
+	float bias[3];
+	// Variances of the attitude error (rad^2) and the gyro bias (rad^2/s^2)
+	float varAtt[3];
+	float varBias[3];
+};
+
+// Maps the settings and output of the filter into the register pages
+void EKFInitialize(void);
+
+// Restarts the filter at attitude 'q' (scalar first) with zero bias
+void EKFReset(const float *q);
+
+// Propagates the filter with the delta theta 'dTheta' over the interval 'dt' and, every
+// 'measDiv' calls, corrects it with the specific force 'f' given local gravity 'g'
+void EKFStep(const float *dTheta, float dt, const float *f, float g);
+
+#endif /* EKF_H_ */
@@ -0,0 +1,66 @@
+/*
+ * fusion.c
+ *
+ *  Description: Robust estimators used to fuse the calibrated data of the sensor array
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "imu.h"
+#include "fusion.h"
+
+// Orders the pair ('a','b') so 'a' holds the smaller value. Written as selects rather
+// than an if-statement so the compiler can use conditional moves instead of branches
+#define COMPARE_EXCHANGE(a,b) { float lo = ((a) < (b)) ? (a) : (b); \
+                                float hi = ((a) < (b)) ? (b) : (a); \
+                                (a) = lo; (b) = hi; }
+
+void SortSensorValues(float *v) {
+
+	uint8_t p, q, r, d, i = 0;
+
+	// Batcher's merge exchange (Knuth, TAOCP Vol. 3, Algorithm 5.2.2M). Which pairs are
+	// compared only depends on NUM_SENSORS, never on the data, so sorting always takes
+	// the same number of compare-exchange operations (191 for 32 sensors).
+	for(p = SORT_NETWORK_TOP; p > 0; p >>= 1) {
+		q = SORT_NETWORK_TOP;
+		r = 0;
+		d = p;
+
+		while(1) {
+			for(i = 0; i < NUM_SENSORS - d; i++) {
+				if((i & p) == r) {
+					COMPARE_EXCHANGE(v[i], v[i + d]);
+				}
+			}
+
+			if(q == p) {
+				break;
+			}
+			d = q - p;
+			q >>= 1;
+			r = p;
+		}
+	}
+}
+
+float TrimmedMean(const float *v, uint8_t count, uint8_t trim) {
+
+	uint8_t i = 0;
+	float sum = 0;
+
+	// Make sure at least one value is left over
+	if(count == 0) {
+		return 0;
+	}
+	if(2*trim >= count) {
+		trim = (count - 1) / 2;
+	}
+
+	for(i = trim; i < count - trim; i++) {
+		sum += v[i];
+	}
+
+	return sum / (float)(count - 2*trim);
+}
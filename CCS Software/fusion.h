@@ -0,0 +1,23 @@
+/*
+ * fusion.h
+ *
+ *  Description: Robust estimators used to fuse the calibrated data of the sensor array
+ */
+
+#ifndef FUSION_H_
+#define FUSION_H_
+
+// Largest power of two that is less than the number of sensors. Sets the size of the
+// sorting network at compile time.
+#define SORT_NETWORK_TOP            ((NUM_SENSORS > 32) ? 32 : (NUM_SENSORS > 16) ? 16 : \
+                                     (NUM_SENSORS > 8) ? 8 : (NUM_SENSORS > 4) ? 4 : \
+                                     (NUM_SENSORS > 2) ? 2 : 1)
+
+// Sorts the NUM_SENSORS values in 'v' into ascending order
+void SortSensorValues(float *v);
+
+// Returns the mean of the first 'count' values of the sorted array 'v', ignoring the
+// 'trim' smallest and 'trim' largest values
+float TrimmedMean(const float *v, uint8_t count, uint8_t trim);
+
+#endif /* FUSION_H_ */
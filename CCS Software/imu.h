@@ -4,7 +4,6 @@
  *  Created on: Oct 4, 2015
  *      Author: Daniel Greenheck
  */
-#include "driverlib/gpio.h"
 
 #ifndef IMU_H_
 #define IMU_H_
@@ -108,78 +107,11 @@
 
 
 // ********************************************
-// CHIP SELECT PIN ASSIGNMENTS
+// CHIP SELECT PIN ASSIGNMENTS (imu.c)
 // ********************************************
 
-static const uint32_t IMU_PORT_BASE[32] = {
-	GPIO_PORTC_BASE,	// IMU 1
-	GPIO_PORTC_BASE,	// IMU 2
-	GPIO_PORTC_BASE,	// IMU 3
-	GPIO_PORTC_BASE,	// IMU 4
-	GPIO_PORTE_BASE,	// IMU 5
-	GPIO_PORTE_BASE,	// IMU 6
-	GPIO_PORTE_BASE,	// IMU 7
-	GPIO_PORTE_BASE,	// IMU 8
-	GPIO_PORTD_BASE,	// IMU 9
-	GPIO_PORTD_BASE,	// IMU 10
-	GPIO_PORTD_BASE,	// IMU 11
-	GPIO_PORTD_BASE,	// IMU 12
-	GPIO_PORTP_BASE,	// IMU 13
-	GPIO_PORTP_BASE,	// IMU 14
-	GPIO_PORTP_BASE,	// IMU 15
-	GPIO_PORTQ_BASE,	// IMU 16
-	GPIO_PORTB_BASE,	// IMU 17
-	GPIO_PORTB_BASE,	// IMU 18
-	GPIO_PORTL_BASE,	// IMU 19
-	GPIO_PORTL_BASE,	// IMU 20
-	GPIO_PORTL_BASE,	// IMU 21
-	GPIO_PORTL_BASE,	// IMU 22
-	GPIO_PORTL_BASE,	// IMU 23
-	GPIO_PORTL_BASE,	// IMU 24
-	GPIO_PORTK_BASE,	// IMU 25
-	GPIO_PORTK_BASE,	// IMU 26
-	GPIO_PORTK_BASE,	// IMU 27
-	GPIO_PORTA_BASE,	// IMU 28
-	GPIO_PORTA_BASE,	// IMU 29
-	GPIO_PORTA_BASE,	// IMU 30
-	GPIO_PORTA_BASE,	// IMU 31
-	GPIO_PORTA_BASE		// IMU 32
-};
-
-static const uint8_t IMU_PIN[32] = {
-	GPIO_PIN_4,			// IMU 1
-	GPIO_PIN_5,			// IMU 2
-	GPIO_PIN_6,			// IMU 3
-	GPIO_PIN_7,			// IMU 4
-	GPIO_PIN_0,			// IMU 5
-	GPIO_PIN_1,			// IMU 6
-	GPIO_PIN_2,			// IMU 7
-	GPIO_PIN_3,			// IMU 8
-	GPIO_PIN_7,			// IMU 9
-	GPIO_PIN_6,			// IMU 10
-	GPIO_PIN_5,			// IMU 11
-	GPIO_PIN_4,			// IMU 12
-	GPIO_PIN_4,			// IMU 13
-	GPIO_PIN_3,			// IMU 14
-	GPIO_PIN_2,			// IMU 15
-	GPIO_PIN_4,			// IMU 16
-	GPIO_PIN_1,			// IMU 17
-	GPIO_PIN_0,			// IMU 18
-	GPIO_PIN_5,			// IMU 19
-	GPIO_PIN_4,			// IMU 20
-	GPIO_PIN_3,			// IMU 21
-	GPIO_PIN_2,			// IMU 22
-	GPIO_PIN_1,			// IMU 23
-	GPIO_PIN_0,			// IMU 24
-	GPIO_PIN_5,			// IMU 25
-	GPIO_PIN_6,			// IMU 26
-	GPIO_PIN_7,			// IMU 27
-	GPIO_PIN_6,			// IMU 28
-	GPIO_PIN_5,			// IMU 29
-	GPIO_PIN_4,			// IMU 30
-	GPIO_PIN_3,			// IMU 31
-	GPIO_PIN_2			// IMU 32
-};
+extern const uint32_t IMU_PORT_BASE[32];
+extern const uint8_t IMU_PIN[32];
 
 // ***********************************************
 // FUNCTION DEFINITIONS
@@ -1,7 +1,9 @@
+#include <float.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "inc/hw_gpio.h"
 #include "inc/hw_hibernate.h"
@@ -25,11 +27,16 @@
 #include "utils/ustdlib.h"
 
 #include "cobs.h"
+#include "crc.h"
+#include "ekf.h"
+#include "fusion.h"
 #include "main.h"
 
 #include "imu.h"
+#include "calibration.h"
 #include "registers.h"
 #include "sd.h"
+#include "strapdown.h"
 #include "util.h"
 #include "vector3.h"
 
@@ -51,15 +58,6 @@ char pcBuffer[128];
 // DATA AND CALIBRATION
 // *******************************************************************************
 
-// Raw data for a single IMU
-struct IMURawData {
-	int16_t data[7];
-};
-// Raw data for multiple IMUs plus a time stamp
-struct RawDataQueue {
-	uint32_t timeStamp;
-	struct IMURawData sensor[NUM_SENSORS];
-};
 // Create queue (or first-in-first-out buffer) so we can store up multiple data records
 // Writing to the SD card can lock up the main loop for some time so this queue stores
 // incoming data during that write period.
@@ -89,60 +87,299 @@ struct ProcDataRecord {
 	float angVel[3];
 	// Averaged specific force
 	float specificForce[3];
+	// Gravity compensated velocity in the navigation frame
+	float vel[3];
+	// Position in the navigation frame
+	float pos[3];
+	// Attitude quaternion of the gravity-referenced attitude filter
+	float filterQ[4];
 };
 // Most up-to-date output of IMU
 struct ProcDataRecord processedData;
 
-// Calibrated data samples
-float dataCal[NUM_SENSORS][NUM_IMU_VALUES] = {0};
-// Calibrated temperature of sensors
-float tempCal[NUM_SENSORS] = {0};
-// Averaged data samples
-float dataAvgd[3][NUM_IMU_VALUES] = {0};
+// Last SAMPLE_WINDOW averaged data samples (sliding window, newest sample at 'sampleIdx')
+float dataAvgd[SAMPLE_WINDOW][NUM_IMU_VALUES] = {0};
+// Angle and velocity increments over each sample interval since the last attitude update
+float dThetaInc[CONING_MAX_SAMPLES][3] = {0};
+float dVInc[CONING_MAX_SAMPLES][3] = {0};
 
 // OUTPUTS
 // Integrated attitude quaternion
 float q[4] = {1,0,0,0};
 // Latest delta theta
 float dTheta[3] = {0,0,0};
-// Delta theta represented as quaternion
-float q1[4] = {1,0,0,0};
 // Latest delta velocity
 float dV[3] = {0,0,0};
 // Accumulated velocity
-float accVel[3] = {0,0,0};
+struct CompensatedSum accVel[3] = {{0}};
 // Average temperature of the sensors
 float tempAvg = 0;
+// Latest delta velocity in the navigation frame
+float dVNav[3] = {0,0,0};
+// Gravity compensated velocity and position in the navigation frame. The navigation frame
+// is the body frame at start-up (or after alignment) with Z pointing up.
+struct CompensatedSum vel[3] = {{0}};
+struct CompensatedSum pos[3] = {{0}};
+
+// Navigation settings, writable by the master through PAGE_NAV_CFG
+struct NavigationConfig {
+	// Local gravity in m/s^2. If zero or negative, gravity is computed from the latitude
+	// and height with the WGS-84 normal gravity model.
+	float gravity;
+	// Latitude in degrees
+	float latitude;
+	// Height above the ellipsoid in m
+	float height;
+	// Threshold of the zero-velocity detector, zero or negative disables the velocity resets
+	float zuptThreshold;
+	// Number of samples averaged by an alignment
+	uint32_t alignSamples;
+};
+struct NavigationConfig navConfig = {GRAVITY, 0, 0, ZUPT_THRESHOLD_DEFAULT, ALIGN_SAMPLES_DEFAULT};
+// Copy of the settings the master writes to. The I2C interrupt writes it one byte at a
+// time, it is only copied to 'navConfig' at the stop condition (see CommitNavigationConfig).
+struct NavigationConfig navConfigWrite = {GRAVITY, 0, 0, ZUPT_THRESHOLD_DEFAULT, ALIGN_SAMPLES_DEFAULT};
+
+// Alignment in progress (see AlignmentTask). The data is averaged with running sums, so
+// the averaging window can be any length.
+struct Alignment {
+	// Current step of the alignment (ALIGN_STAT_*)
+	uint8_t phase;
+	// True if the heading is aligned as well
+	bool heading;
+	// Number of samples summed so far
+	uint32_t count;
+	// Sums of the fused specific force and angular rate
+	struct CompensatedSum acc[3];
+	struct CompensatedSum gyro[3];
+};
+struct Alignment align;
+
+// Navigation output readable through PAGE_NAV, updated along with the output registers
+struct NavigationOutput {
+	float vel[3];
+	float pos[3];
+	// Local gravity in use
+	float gravity;
+};
+struct NavigationOutput navOutput;
+
+// Gains of the attitude filter, writable by the master through PAGE_FILTER_CFG
+struct AttitudeFilterConfig {
+	// Proportional gain (rad/s per unit of gravity direction error)
+	float kp;
+	// Integral gain (rad/s^2 per unit of gravity direction error)
+	float ki;
+};
+struct AttitudeFilterConfig filterConfig = {ATT_FILTER_KP, ATT_FILTER_KI};
+
+// State of the gravity-referenced attitude filter (Mahony's explicit complementary filter)
+struct AttitudeFilter {
+	// Attitude quaternion (body to navigation frame, scalar first)
+	float q[4];
+	// Integral of the correction, i.e. the estimated gyro bias (rad/s)
+	float wInt[3];
+};
+struct AttitudeFilter attFilter = {{1,0,0,0}, {0,0,0}};
 
-
-struct CalibrationCoefficients {
-	// Bias coefficients
-	float b[6];
-	// Scale factor coefficients
-	float S[6];
-	// Misalignment coefficients
-	float M[6];
-	// Temperature coefficients
-	float T[6];
-	// Gyro g-sensitivity coefficients
-	float G[9];
-	// Accelerometer inverted scale factor/misalignment matrix
-	float A_ISM[9];
-	// Gyro inverted scale factor/misalignment matrix
-	float G_ISM[9];
+// Other representations of the integrated attitude, readable through PAGE_ATTITUDE. They
+// are only computed when the master reads the page (or every output period if subscribed),
+// so they are at most one output period old, like the IQUAT registers they derive from.
+struct DerivedAttitude {
+	// Time stamp of the output record the attitude belongs to
+	uint32_t timeStamp;
+	// Roll, pitch and yaw (rad, Z-Y-X rotation order)
+	float euler[3];
+	// Body to navigation frame direction cosine matrix (row-major)
+	float dcm[9];
+	// Rotation vector (rad)
+	float rotVec[3];
 };
-struct CalibrationCoefficients cc[NUM_SENSORS];
+struct DerivedAttitude derivedAtt;
+
+// Attitude of the last output record (scalar first) and its time stamp. derivedStale is
+// set when derivedAtt has not been computed from it yet.
+float derivedQ[4] = {1,0,0,0};
+uint32_t derivedTimeStamp = 0;
+volatile bool derivedStale = true;
+
+
+
+// Body to navigation frame rotation matrix (row-major), computed from 'q' after each
+// attitude update
+float Cbn[9] = {1,0,0, 0,1,0, 0,0,1};
 
 // Keeps track of number of samples acquired for integration
-uint32_t sampleCount = 0;
+uint8_t sampleIdx = 0;
+uint8_t sampleFill = 0;
+uint8_t incCount = 0;
 uint32_t outputCount = 0;
+// Attitude updates since the last exact quaternion normalization
+uint16_t renormCount = 0;
+
+// Data queue settings, writable through PAGE_QUEUE_CFG
+struct QueueConfig {
+	// Queue depth at which catch-up mode starts
+	uint16_t catchUpThreshold;
+};
+struct QueueConfig queueConfig = {CATCH_UP_THRESHOLD_DEFAULT};
+
+// Number of records that are still certain to be processed after the current one. In
+// catch-up mode, outputs that will be superseded before the backlog is gone are not
+// written to the registers.
+uint16_t recordsAhead = 0;
+
+// Inverse-variance fusion weights of each sensor, stored axis-major (normalized so
+// the weights of each axis add up to one)
+float fusionWeight[NUM_IMU_VALUES][NUM_SENSORS];
+
+// Running statistics (Welford's algorithm) of the residual between each sensor and the
+// array mean. Used to compute the fusion weights.
+struct SensorNoise {
+	// Mean residual
+	float mean[NUM_IMU_VALUES][NUM_SENSORS];
+	// Sum of squared deviations from the mean residual
+	float m2[NUM_IMU_VALUES][NUM_SENSORS];
+	// Number of samples
+	float n;
+};
+struct SensorNoise noise;
+
+// Sliding window of the averaged data used to detect static intervals. The sums are taken
+// relative to a reference close to the window mean, so the running sum of squares does
+// not lose the (small) variance to round-off against the (large) mean. They are updated
+// as samples enter and leave the window, so each sample costs the same.
+struct StaticDetector {
+	// Reference subtracted from the samples in the sums
+	float ref[NUM_IMU_VALUES];
+	// Last STATIC_WINDOW samples
+	float window[STATIC_WINDOW][NUM_IMU_VALUES];
+	// Running sum and sum of squares of the samples in the window, minus the reference
+	float sum[NUM_IMU_VALUES];
+	float sumSq[NUM_IMU_VALUES];
+	// Position of the oldest sample and number of samples in the window
+	uint16_t idx;
+	uint16_t fill;
+	// True if the last STATIC_WINDOW samples were static
+	bool isStatic;
+};
+struct StaticDetector detector;
+
+// Zero-velocity detector. The window sums are updated as samples enter and leave the
+// window, so the test costs the same for any window length.
+struct ZUPTDetector {
+	// Last ZUPT_WINDOW samples (specific force and squared norm of the angular rate)
+	float window[ZUPT_WINDOW][4];
+	// Reference subtracted from the specific force in the sums, keeps them small
+	float ref[3];
+	// Sums of the specific force minus the reference, of its squared norm and of the
+	// squared norm of the angular rate over the window
+	float sumAcc[3];
+	float sumAccSq;
+	float sumGyroSq;
+	// Position of the oldest sample and number of samples in the window
+	uint8_t idx;
+	uint8_t fill;
+	// Last value of the test statistic and the decision
+	float statistic;
+	bool isStationary;
+};
+struct ZUPTDetector zupt;
+
+// Gyro bias estimated during static intervals, in deg/s. The sensor estimates are
+// subtracted by the calibration on top of the calibration coefficients.
+struct GyroBiasEstimate {
+	// Bias of the array (mean of the sensor estimates)
+	float array[3];
+	// Bias of each sensor
+	float sensor[3][NUM_SENSORS];
+	// Number of static samples the estimates are based on
+	uint32_t samples;
+};
+struct GyroBiasEstimate gyroBias;
+
+// Progress of a calibration upload
+struct CalibrationUpload {
+	// Current step of the upload (CAL_UPLOAD_*)
+	uint8_t phase;
+	// Bank of 'ccBank' and 'calTables' receiving the new coefficients
+	uint8_t shadow;
+	// First sensor and number of sensors being uploaded
+	uint8_t first;
+	uint8_t count;
+	// Next sensor to verify/compute
+	uint8_t next;
+	// Running CRC of the uploaded coefficients
+	uint32_t crc;
+	// Tick count when the BEGIN and COMMIT commands were received
+	uint32_t beginTick;
+	uint32_t commitTick;
+	// CPU cycles spent verifying and computing so far
+	uint32_t cycles;
+};
+struct CalibrationUpload calUpload;
+
+// Statistics readable over I2C through PAGE_STATS
+struct ProcessingStats {
+	// Number of bytes in the last calibration upload
+	uint32_t calUploadBytes;
+	// Samples between the BEGIN and COMMIT commands of the last calibration upload
+	// (upload throughput is calUploadBytes * SAMPLE_RATE / calUploadTicks)
+	uint32_t calUploadTicks;
+	// Samples between the COMMIT command and the new coefficients going into use
+	uint32_t calSwapLatencyTicks;
+	// CPU cycles spent verifying the upload and computing the new tables
+	uint32_t calCommitCycles;
+	// CPU cycles the processing stage was held up by the bank swap
+	uint32_t calSwapCycles;
+	// CPU cycles of the last attitude and velocity update
+	uint32_t attitudeCycles;
+	// Error of the squared norm of the attitude quaternion before the last normalization
+	float quatNormError;
+	// CPU cycles of the last attitude filter update
+	uint32_t filterCycles;
+	// CPU cycles of the last Kalman filter step
+	uint32_t ekfCycles;
+	// CPU cycles of the last computation of the derived attitude representations
+	uint32_t derivedCycles;
+	// Number of times they were computed
+	uint32_t derivedCount;
+	// Number of times catch-up mode was entered
+	uint32_t catchUpCount;
+	// Queue depth when catch-up mode was last entered
+	uint32_t catchUpDepth;
+	// Records processed, samples elapsed (time to drain the backlog) and CPU cycles spent
+	// during the last catch-up
+	uint32_t catchUpRecords;
+	uint32_t catchUpTicks;
+	uint32_t catchUpCycles;
+	// Register outputs skipped because they were superseded during catch-up
+	uint32_t catchUpSkipped;
+	// Number of zero-velocity updates applied
+	uint32_t zuptCount;
+	// Output records dropped because the register FIFO was full (only counted once the
+	// master has selected PAGE_FIFO)
+	uint32_t fifoOverflows;
+	// CPU cycles taken by the old two-stage calibrate-then-average path for a single record,
+	// to compare with REG_FUSION_CYCLES (only measured with PROFILE_TWO_STAGE_CAL)
+	uint32_t twoStageCalCycles;
+	// CPU cycles taken to calibrate and fuse a record in each fusion mode (FUSION_*) and with
+	// the group calibration, measured the last time the mode was active. A mode reads 0
+	// until the master has selected it, so select each mode in turn to compare them.
+	uint32_t fusionCycles[FUSION_MODE_COUNT];
+	uint32_t groupCalCycles;
+};
+struct ProcessingStats stats;
+
+// Number of CPU cycles taken to calibrate and fuse a single record (latest batch)
+uint32_t calCyclesPerRecord = 0;
 
 // Arrays used for encoding data
 char rawData1[RAW_PKT_SIZE_1 - 2] = {0};
 char rawData2[RAW_PKT_SIZE_2 - 2] = {0};
 char calData[CAL_PKT_SIZE - 2] = {0};
 char rawEncodedData[RAW_PKT_SIZE_1 + RAW_PKT_SIZE_2] = {0};
-char calEncodedData[CAL_PKT_SIZE] = {0};
+char calEncodedData[CAL_PKT_SIZE + NAV_PKT_SIZE] = {0};
 
 // *******************************************************************************
 // SD
@@ -305,9 +542,18 @@ void ConfigurePeripherals(void) {
 
     // Configure and turn on the I2C0 slave interrupt.  The I2CSlaveIntEnableEx()
     // gives you the ability to only enable specific interrupts.  For this case
-    // we are only interrupting when the slave device receives data.
+    // we are only interrupting when the slave device receives data. The transmit FIFO
+    // request interrupt is only enabled while the master is reading (see registers.c).
     I2CSlaveIntEnableEx(CDH_I2C_BASE, I2C_SLAVE_INT_DATA | I2C_SLAVE_INT_START | I2C_SLAVE_INT_STOP);
 
+    // Send the data read by the master through the transmit FIFO, so a burst read takes an
+    // interrupt every few bytes instead of every byte. The FIFO asks for more data once
+    // it is down to half full. Data written by the master is still taken one byte at a
+    // time, so each byte is checked against the register it goes to.
+    I2CTxFIFOConfigSet(CDH_I2C_BASE, I2C_FIFO_CFG_TX_SLAVE | I2C_FIFO_CFG_TX_TRIG_4);
+    I2CTxFIFOFlush(CDH_I2C_BASE);
+    I2CSlaveFIFOEnable(CDH_I2C_BASE, I2C_SLAVE_TX_FIFO_ENABLE);
+
     // Enable the I2C0 slave module.
     I2CSlaveEnable(CDH_I2C_BASE);
 
@@ -389,69 +635,309 @@ void ConfigureTimers(void) {
     ROM_SysTickEnable();
     ROM_SysTickIntEnable();
 
+    // Start the CPU cycle counter used to profile the data processing
+    CYCLE_COUNTER_ENABLE();
+
 #ifdef DEBUG_MODE
 	UARTprintf("done\n");
 #endif
 
 }
 
-void LoadCalibrationCoefficients() {
+float GetGyroBiasCorrection(uint8_t axis, uint8_t i) {
 
-	// TODO: Load calibration coefficients from SD card
+	uint8_t s = 0;
+	float sum = 0;
 
-#ifdef DEBUG_MODE
-	UARTprintf("\tComputing inverse of misalignment & scale-factor matrices... ");
-#endif
+	if(i < NUM_SENSORS) {
+		return gyroBias.sensor[axis][i];
+	}
+
+	// Groups get the mean correction of their sensors
+	for(s = (i - NUM_SENSORS)*GROUP_SIZE; s < (i - NUM_SENSORS + 1)*GROUP_SIZE; s++) {
+		sum += gyroBias.sensor[axis][s];
+	}
+	return sum / GROUP_SIZE;
+}
+
+void ComputeCalibrationTable(const struct CalibrationCoefficients *c, struct CalibrationTable *t, uint8_t i) {
 
 	// ***************************************************************************************
 	// Pre-compute the inverse of the misalignment-scale factor matrix used in the calibration
 	// ***************************************************************************************
 
-    int i;
+    int j;
     float a_den = 0;
+    float g_den = 0;
 
     // Accelerometer
-    for(i = 0; i < NUM_SENSORS; i++) {
-        // Calculate the denominator
-        a_den = (cc[i].S[0] + cc[i].S[1] + cc[i].S[2] + cc[i].S[0]*cc[i].S[1] + cc[i].S[0]*cc[i].S[2] + cc[i].S[1]*cc[i].S[2] +
-            cc[i].M[1]*cc[i].M[1]*cc[i].S[1] + cc[i].M[2]*cc[i].M[2]*cc[i].S[0] + cc[i].M[0]*cc[i].M[0]*cc[i].S[2] + cc[i].M[0]*cc[i].M[0] +
-            cc[i].M[1]*cc[i].M[1] + cc[i].M[2]*cc[i].M[2] + cc[i].S[0]*cc[i].S[1]*cc[i].S[2] + 1);
-
-        cc[i].A_ISM[0] =  (cc[i].M[2]*cc[i].M[2] + cc[i].S[1] + cc[i].S[2] + cc[i].S[1]*cc[i].S[2] + 1) / a_den;
-        cc[i].A_ISM[1] = -(cc[i].M[0] + cc[i].M[0]*cc[i].S[2] + cc[i].M[1]*cc[i].M[2]) / a_den;
-        cc[i].A_ISM[2] = -(cc[i].M[1] + cc[i].M[1]*cc[i].S[1] - cc[i].M[0]*cc[i].M[2]) / a_den;
-        cc[i].A_ISM[3] =  (cc[i].M[0] + cc[i].M[0]*cc[i].S[2] - cc[i].M[1]*cc[i].M[2]) / a_den;
-        cc[i].A_ISM[4] =  (cc[i].M[1]*cc[i].M[1] + cc[i].S[0] + cc[i].S[2] + cc[i].S[0]*cc[i].S[2] + 1) / a_den;
-        cc[i].A_ISM[5] = -(cc[i].M[2] + cc[i].M[2]*cc[i].S[0] + cc[i].M[0]*cc[i].M[1]) / a_den;
-        cc[i].A_ISM[6] =  (cc[i].M[1] + cc[i].M[1]*cc[i].S[1] + cc[i].M[0]*cc[i].M[2]) / a_den;
-        cc[i].A_ISM[7] =  (cc[i].M[2] + cc[i].M[2]*cc[i].S[0] - cc[i].M[0]*cc[i].M[1]) / a_den;
-        cc[i].A_ISM[8] =  (cc[i].M[0]*cc[i].M[0] + cc[i].S[0] + cc[i].S[1] + cc[i].S[0]*cc[i].S[1] + 1) / a_den;
-    }
+    // Calculate the denominator
+    a_den = (c->S[0] + c->S[1] + c->S[2] + c->S[0]*c->S[1] + c->S[0]*c->S[2] + c->S[1]*c->S[2] +
+        c->M[1]*c->M[1]*c->S[1] + c->M[2]*c->M[2]*c->S[0] + c->M[0]*c->M[0]*c->S[2] + c->M[0]*c->M[0] +
+        c->M[1]*c->M[1] + c->M[2]*c->M[2] + c->S[0]*c->S[1]*c->S[2] + 1);
+
+    t->A_ISM[0][i] =  (c->M[2]*c->M[2] + c->S[1] + c->S[2] + c->S[1]*c->S[2] + 1) / a_den;
+    t->A_ISM[1][i] = -(c->M[0] + c->M[0]*c->S[2] + c->M[1]*c->M[2]) / a_den;
+    t->A_ISM[2][i] = -(c->M[1] + c->M[1]*c->S[1] - c->M[0]*c->M[2]) / a_den;
+    t->A_ISM[3][i] =  (c->M[0] + c->M[0]*c->S[2] - c->M[1]*c->M[2]) / a_den;
+    t->A_ISM[4][i] =  (c->M[1]*c->M[1] + c->S[0] + c->S[2] + c->S[0]*c->S[2] + 1) / a_den;
+    t->A_ISM[5][i] = -(c->M[2] + c->M[2]*c->S[0] + c->M[0]*c->M[1]) / a_den;
+    t->A_ISM[6][i] =  (c->M[1] + c->M[1]*c->S[1] + c->M[0]*c->M[2]) / a_den;
+    t->A_ISM[7][i] =  (c->M[2] + c->M[2]*c->S[0] - c->M[0]*c->M[1]) / a_den;
+    t->A_ISM[8][i] =  (c->M[0]*c->M[0] + c->S[0] + c->S[1] + c->S[0]*c->S[1] + 1) / a_den;
 
     // GyroScope
-    float g_den = 0;
-    for(i = 0; i < NUM_SENSORS; i++) {
-        // Calculate the denominator
-        g_den = (cc[i].S[3] + cc[i].S[4] + cc[i].S[5] + cc[i].S[3]*cc[i].S[4] + cc[i].S[3]*cc[i].S[5] + cc[i].S[4]*cc[i].S[5] +
-            cc[i].M[4]*cc[i].M[4]*cc[i].S[4] + cc[i].M[5]*cc[i].M[5]*cc[i].S[3] + cc[i].M[3]*cc[i].M[3]*cc[i].S[5] + cc[i].M[3]*cc[i].M[3] +
-            cc[i].M[4]*cc[i].M[4] + cc[i].M[5]*cc[i].M[5] + cc[i].S[3]*cc[i].S[4]*cc[i].S[5] + 1);
-
-        cc[i].G_ISM[0] =  (cc[i].M[5]*cc[i].M[5] + cc[i].S[4] + cc[i].S[5] + cc[i].S[4]*cc[i].S[5] + 1) / g_den;
-        cc[i].G_ISM[1] = -(cc[i].M[3] + cc[i].M[3]*cc[i].S[5] + cc[i].M[4]*cc[i].M[5]) / g_den;
-        cc[i].G_ISM[2] = -(cc[i].M[4] + cc[i].M[4]*cc[i].S[4] - cc[i].M[3]*cc[i].M[5]) / g_den;
-        cc[i].G_ISM[3] =  (cc[i].M[3] + cc[i].M[3]*cc[i].S[5] - cc[i].M[4]*cc[i].M[5]) / g_den;
-        cc[i].G_ISM[4] =  (cc[i].M[4]*cc[i].M[4] + cc[i].S[3] + cc[i].S[5] + cc[i].S[3]*cc[i].S[5] + 1) / g_den;
-        cc[i].G_ISM[5] = -(cc[i].M[5] + cc[i].M[5]*cc[i].S[3] + cc[i].M[3]*cc[i].M[4]) / g_den;
-        cc[i].G_ISM[6] =  (cc[i].M[4] + cc[i].M[4]*cc[i].S[4] + cc[i].M[3]*cc[i].M[5]) / g_den;
-        cc[i].G_ISM[7] =  (cc[i].M[5] + cc[i].M[5]*cc[i].S[3] - cc[i].M[3]*cc[i].M[4]) / g_den;
-        cc[i].G_ISM[8] =  (cc[i].M[3]*cc[i].M[3] + cc[i].S[3] + cc[i].S[4] + cc[i].S[3]*cc[i].S[4] + 1) / g_den;
+    // Calculate the denominator
+    g_den = (c->S[3] + c->S[4] + c->S[5] + c->S[3]*c->S[4] + c->S[3]*c->S[5] + c->S[4]*c->S[5] +
+        c->M[4]*c->M[4]*c->S[4] + c->M[5]*c->M[5]*c->S[3] + c->M[3]*c->M[3]*c->S[5] + c->M[3]*c->M[3] +
+        c->M[4]*c->M[4] + c->M[5]*c->M[5] + c->S[3]*c->S[4]*c->S[5] + 1);
+
+    t->G_ISM[0][i] =  (c->M[5]*c->M[5] + c->S[4] + c->S[5] + c->S[4]*c->S[5] + 1) / g_den;
+    t->G_ISM[1][i] = -(c->M[3] + c->M[3]*c->S[5] + c->M[4]*c->M[5]) / g_den;
+    t->G_ISM[2][i] = -(c->M[4] + c->M[4]*c->S[4] - c->M[3]*c->M[5]) / g_den;
+    t->G_ISM[3][i] =  (c->M[3] + c->M[3]*c->S[5] - c->M[4]*c->M[5]) / g_den;
+    t->G_ISM[4][i] =  (c->M[4]*c->M[4] + c->S[3] + c->S[5] + c->S[3]*c->S[5] + 1) / g_den;
+    t->G_ISM[5][i] = -(c->M[5] + c->M[5]*c->S[3] + c->M[3]*c->M[4]) / g_den;
+    t->G_ISM[6][i] =  (c->M[4] + c->M[4]*c->S[4] + c->M[3]*c->M[5]) / g_den;
+    t->G_ISM[7][i] =  (c->M[5] + c->M[5]*c->S[3] - c->M[3]*c->M[4]) / g_den;
+    t->G_ISM[8][i] =  (c->M[3]*c->M[3] + c->S[3] + c->S[4] + c->S[3]*c->S[4] + 1) / g_den;
+
+    // Pack the remaining coefficients into the axis-major table used by the calibration loop
+    for(j = 0; j < NUM_IMU_VALUES; j++) {
+    	t->b[j][i] = c->b[j];
+    	t->T[j][i] = c->T[j];
+    }
+    for(j = 0; j < 9; j++) {
+    	t->G[j][i] = c->G[j];
+    }
+}
+
+void ComputeGroupCoefficients(struct CalibrationCoefficients *bank, uint8_t g) {
+
+	uint8_t s, j, t = 0;
+	struct CalibrationCoefficients *avg = &bank[NUM_SENSORS + g];
+	struct CalibrationCoefficients *first = &bank[g*GROUP_SIZE];
+	const float invSize = 1.0f / GROUP_SIZE;
+
+	// Average the coefficients of the sensors in the group. The inverse matrices are later
+	// computed from the averaged scale factors and misalignments, which matches the
+	// average of the sensor matrices to first order.
+	for(j = 0; j < NUM_IMU_VALUES; j++) {
+		float b = 0, S = 0, M = 0, T = 0;
+		for(s = 0; s < GROUP_SIZE; s++) {
+			b += first[s].b[j];
+			S += first[s].S[j];
+			M += first[s].M[j];
+			T += first[s].T[j];
+		}
+		avg->b[j] = b*invSize;
+		avg->S[j] = S*invSize;
+		avg->M[j] = M*invSize;
+		avg->T[j] = T*invSize;
+
+		for(t = 0; t < TEMP_LUT_POINTS; t++) {
+			int32_t TB = 0, TS = 0;
+			for(s = 0; s < GROUP_SIZE; s++) {
+				TB += first[s].TB[j][t];
+				TS += first[s].TS[j][t];
+			}
+			avg->TB[j][t] = TB / GROUP_SIZE;
+			avg->TS[j][t] = TS / GROUP_SIZE;
+		}
+	}
+	for(j = 0; j < 9; j++) {
+		float G = 0;
+		for(s = 0; s < GROUP_SIZE; s++) {
+			G += first[s].G[j];
+		}
+		avg->G[j] = G*invSize;
+	}
+}
+
+void LoadCalibrationCoefficients() {
+
+	// TODO: Load calibration coefficients from SD card
+
+#ifdef DEBUG_MODE
+	UARTprintf("\tComputing inverse of misalignment & scale-factor matrices... ");
+#endif
+
+    int i, j;
+    for(i = 0; i < NUM_GROUPS; i++) {
+    	ComputeGroupCoefficients(cc, i);
+    }
+    for(i = 0; i < NUM_CAL_SETS; i++) {
+    	ComputeCalibrationTable(&cc[i], calTable, i);
+    }
+
+    // Compute the temperature compensation for 25 deg C until the first sample comes in
+    for(i = 0; i < NUM_CAL_SETS; i++) {
+    	UpdateTemperatureCompensation(i, 0);
     }
 
+    // Start out weighting all sensors equally
+    for(i = 0; i < NUM_IMU_VALUES; i++) {
+    	for(j = 0; j < NUM_SENSORS; j++) {
+    		fusionWeight[i][j] = 1.0f / NUM_SENSORS;
+    	}
+    }
+    RegMapPage(PAGE_FUSION_WEIGHTS, fusionWeight, sizeof(fusionWeight), false);
+    RegMapPage(PAGE_STATS, &stats, sizeof(stats), false);
+    RegMapPage(PAGE_GYRO_BIAS, &gyroBias, sizeof(gyroBias), false);
+    RegMapPage(PAGE_NAV, &navOutput, sizeof(navOutput), false);
+    RegMapPage(PAGE_NAV_CFG, &navConfigWrite, sizeof(navConfigWrite), true);
+    RegSetPageCommit(PAGE_NAV_CFG, CommitNavigationConfig);
+    RegMapPage(PAGE_FILTER_CFG, &filterConfig, sizeof(filterConfig), true);
+    EKFInitialize();
+    RegMapPage(PAGE_ATTITUDE, &derivedAtt, sizeof(derivedAtt), false);
+    RegSetPageRefresh(PAGE_ATTITUDE, UpdateDerivedAttitude);
+    RegMapPage(PAGE_QUEUE_CFG, &queueConfig, sizeof(queueConfig), true);
+
 #ifdef DEBUG_MODE
 	UARTprintf("done\n");
 #endif
 }
 
+void CalibrationUploadCommand(uint8_t cmd) {
+
+	switch(cmd) {
+		// Copy the active coefficients to the shadow bank and let the master overwrite
+		// the sensors it is uploading
+		case CAL_CMD_BEGIN:
+			calUpload.first = GetCalSensor();
+			calUpload.count = GetCalCount();
+			if((calUpload.count == 0) || (calUpload.first + calUpload.count > NUM_SENSORS)) {
+				RegMapPage(PAGE_CAL_UPLOAD, 0, 0, false);
+				calUpload.phase = CAL_UPLOAD_IDLE;
+				SetCalStatus(CAL_STAT_INVALID);
+				break;
+			}
+			calUpload.shadow = (cc == ccBank[0]) ? 1 : 0;
+			memcpy(ccBank[calUpload.shadow], cc, sizeof(ccBank[0]));
+			memcpy(&calTables[calUpload.shadow], calTable, sizeof(calTables[0]));
+
+			RegMapPage(PAGE_CAL_UPLOAD, &ccBank[calUpload.shadow][calUpload.first],
+					calUpload.count*sizeof(struct CalibrationCoefficients), true);
+			calUpload.beginTick = tickCount;
+			calUpload.phase = CAL_UPLOAD_RECEIVING;
+			SetCalStatus(CAL_STAT_RECEIVING);
+			break;
+		// Stop accepting data and start validating it
+		case CAL_CMD_COMMIT:
+			if(calUpload.phase != CAL_UPLOAD_RECEIVING) {
+				SetCalStatus(CAL_STAT_INVALID);
+				break;
+			}
+			RegMapPage(PAGE_CAL_UPLOAD, 0, 0, false);
+			stats.calUploadBytes = calUpload.count*sizeof(struct CalibrationCoefficients);
+			stats.calUploadTicks = tickCount - calUpload.beginTick;
+
+			calUpload.commitTick = tickCount;
+			calUpload.crc = 0;
+			calUpload.cycles = 0;
+			calUpload.next = calUpload.first;
+			calUpload.phase = CAL_UPLOAD_VERIFY;
+			SetCalStatus(CAL_STAT_BUSY);
+			break;
+		case CAL_CMD_ABORT:
+			if(calUpload.phase != CAL_UPLOAD_RECEIVING) {
+				SetCalStatus(CAL_STAT_INVALID);
+				break;
+			}
+			RegMapPage(PAGE_CAL_UPLOAD, 0, 0, false);
+			calUpload.phase = CAL_UPLOAD_IDLE;
+			SetCalStatus(CAL_STAT_IDLE);
+			break;
+		default:
+			SetCalStatus(CAL_STAT_INVALID);
+			break;
+	}
+}
+
+void CalibrationUploadTask() {
+
+	// Handle commands from the master. Interrupts are disabled so a command written while
+	// the previous one is being cleared is not lost. Commands are ignored while an upload
+	// is being processed.
+	ROM_IntMasterDisable();
+	uint8_t cmd = GetCalCommand();
+	ClearCalCommand();
+	ROM_IntMasterEnable();
+
+	if((cmd != CAL_CMD_NONE) && (calUpload.phase <= CAL_UPLOAD_RECEIVING)) {
+		CalibrationUploadCommand(cmd);
+	}
+
+	// Only process one sensor per pass so the data queue keeps getting serviced
+	uint32_t startCycles = CYCLE_COUNT();
+	struct CalibrationCoefficients *c = &ccBank[calUpload.shadow][calUpload.next];
+
+	switch(calUpload.phase) {
+		case CAL_UPLOAD_VERIFY:
+			calUpload.crc = CRC32(calUpload.crc, (const char*)c, sizeof(*c));
+
+			if(++calUpload.next >= calUpload.first + calUpload.count) {
+				// Discard the upload if it was corrupted, the active bank is untouched
+				if(calUpload.crc != GetCalCRC()) {
+					calUpload.phase = CAL_UPLOAD_IDLE;
+					SetCalStatus(CAL_STAT_CRC_ERROR);
+					break;
+				}
+				calUpload.next = calUpload.first;
+				calUpload.phase = CAL_UPLOAD_COMPUTE;
+			}
+			calUpload.cycles += CYCLE_COUNT() - startCycles;
+			break;
+		case CAL_UPLOAD_COMPUTE:
+			// The group coefficients are averaged from the sensors, so redo the groups of
+			// the uploaded sensors after the sensors themselves
+			if(calUpload.next >= NUM_SENSORS) {
+				ComputeGroupCoefficients(ccBank[calUpload.shadow], calUpload.next - NUM_SENSORS);
+			}
+			ComputeCalibrationTable(c, &calTables[calUpload.shadow], calUpload.next);
+
+			if(++calUpload.next == calUpload.first + calUpload.count) {
+				calUpload.next = NUM_SENSORS + calUpload.first/GROUP_SIZE;
+			}
+			else if(calUpload.next > NUM_SENSORS + (calUpload.first + calUpload.count - 1)/GROUP_SIZE) {
+				calUpload.phase = CAL_UPLOAD_SWAP;
+			}
+			calUpload.cycles += CYCLE_COUNT() - startCycles;
+			stats.calCommitCycles = calUpload.cycles;
+			break;
+		default:
+			break;
+	}
+}
+
+void SwapCalibrationBank() {
+
+	uint32_t startCycles = CYCLE_COUNT();
+	uint8_t i;
+
+	// Switch the calibration loop over to the new coefficients
+	cc = ccBank[calUpload.shadow];
+	calTable = &calTables[calUpload.shadow];
+
+	// The temperature compensation depends on the coefficients, so redo it for the
+	// uploaded sensors at their current temperature. The bias estimates were relative to
+	// the old coefficients, so start over.
+	for(i = calUpload.first; i < calUpload.first + calUpload.count; i++) {
+		gyroBias.sensor[X][i] = 0;
+		gyroBias.sensor[Y][i] = 0;
+		gyroBias.sensor[Z][i] = 0;
+		UpdateTemperatureCompensation(i, tempComp.temp[i]);
+	}
+	for(i = calUpload.first/GROUP_SIZE; i <= (calUpload.first + calUpload.count - 1)/GROUP_SIZE; i++) {
+		UpdateTemperatureCompensation(NUM_SENSORS + i, tempComp.temp[NUM_SENSORS + i]);
+	}
+
+	stats.calSwapCycles = CYCLE_COUNT() - startCycles;
+	stats.calSwapLatencyTicks = tickCount - calUpload.commitTick;
+	calUpload.phase = CAL_UPLOAD_IDLE;
+	SetCalStatus(CAL_STAT_DONE);
+}
+
 
 // *******************************************************************************
 // DATA ACQUISITION
@@ -542,124 +1028,278 @@ void GetIMUData(uint32_t timeStamp) {
 	queueRecords++;
 }
 
-void CalibrateData(uint16_t k) {
+void RobustAverageData(uint16_t n, uint8_t count, uint8_t mode) {
 
-	uint8_t i = 0;
+	uint16_t j = 0;
+	uint8_t i, s = 0;
+	// Copy of the data being sorted so the per-sensor data is left intact
+	float v[NUM_SENSORS];
 
-	// Temporary array to store intermediate calculations
-	float tmp[6] = {0};
+	// The median is the trimmed mean with all but the middle one or two values trimmed
+	uint8_t trim = 0;
+	if(mode == FUSION_MEDIAN) {
+		trim = (count - 1) / 2;
+	}
+	else {
+		trim = (count * GetFusionTrim()) >> 5;
+	}
 
-	// Calibrate each sensor individually
-	for(i = 0; i < NUM_SENSORS; i++) {
-		// Check to see if this sensor is enabled
-		if(IsIMUEnabled(i)) {
-			// Calibrate temperature
-			tempCal[i] = (queue[k].sensor[i].data[TEMP] / 326.8) + 25;
-			// Calculate temperature deviation from 25 deg C
-			float dT = tempCal[i] - 25;
+	for(j = 0; j < n; j++) {
+		for(i = 0; i < NUM_IMU_VALUES; i++) {
+			for(s = 0; s < NUM_SENSORS; s++) {
+				v[s] = dataCal[j][i][s];
+			}
+			// Disabled sensors are stored as FLT_MAX so only the enabled ones are at the front
+			SortSensorValues(v);
+			dataFused[j][i] = TrimmedMean(v, count, trim);
+		}
 
-			// Calculate true specific force
-			// a_true = (K_a)*a-meas - bias - temp bias
-			tmp[AX] = (K_A)*queue[k].sensor[i].data[AX] - cc[i].b[AX] - cc[i].T[AX]*dT;
-			tmp[AY] = (K_A)*queue[k].sensor[i].data[AY] - cc[i].b[AY] - cc[i].T[AY]*dT;
-			tmp[AZ] = (K_A)*queue[k].sensor[i].data[AZ] - cc[i].b[AZ] - cc[i].T[AZ]*dT;
+		// Convert from g's to m/s^2
+		dataFused[j][AX] *= GRAVITY;
+		dataFused[j][AY] *= GRAVITY;
+		dataFused[j][AZ] *= GRAVITY;
+		// Convert degrees to radians
+		dataFused[j][GX] *= DEG_TO_RAD;
+		dataFused[j][GY] *= DEG_TO_RAD;
+		dataFused[j][GZ] *= DEG_TO_RAD;
+	}
+}
 
-			// Multiply by inverse of accelerometer misalignment/scale factor matrix
-			dataCal[i][AX] = cc[i].A_ISM[0]*tmp[AX] + cc[i].A_ISM[1]*tmp[AY] + cc[i].A_ISM[2]*tmp[AZ];
-			dataCal[i][AY] = cc[i].A_ISM[3]*tmp[AX] + cc[i].A_ISM[4]*tmp[AY] + cc[i].A_ISM[5]*tmp[AZ];
-			dataCal[i][AZ] = cc[i].A_ISM[6]*tmp[AX] + cc[i].A_ISM[7]*tmp[AY] + cc[i].A_ISM[8]*tmp[AZ];
+void UpdateSensorNoise(uint16_t j, uint8_t count) {
 
-			// Calculate true angular rate
-			// w_true = (K_g)*w_meas - bias - temp bias - g-sensitivity
-			tmp[GX] = (K_G)*queue[k].sensor[i].data[GX] - cc[i].b[GX] - cc[i].T[GX]*dT - cc[i].G[0]*dataCal[i][AX] - cc[i].G[1]*dataCal[i][AY] - cc[i].G[2]*dataCal[i][AZ];
-			tmp[GY] = (K_G)*queue[k].sensor[i].data[GY] - cc[i].b[GY] - cc[i].T[GY]*dT - cc[i].G[3]*dataCal[i][AX] - cc[i].G[4]*dataCal[i][AY] - cc[i].G[5]*dataCal[i][AZ];
-			tmp[GZ] = (K_G)*queue[k].sensor[i].data[GZ] - cc[i].b[GZ] - cc[i].T[GZ]*dT - cc[i].G[6]*dataCal[i][AX] - cc[i].G[7]*dataCal[i][AY] - cc[i].G[8]*dataCal[i][AZ];
+	uint8_t i, s = 0;
+	uint32_t enable = 0;
 
-			// Multiply by inverse of gyroscope misalignment/scale factor matrix
-			dataCal[i][GX] = cc[i].G_ISM[0]*tmp[GX] + cc[i].G_ISM[1]*tmp[GY] + cc[i].G_ISM[2]*tmp[GZ];
-			dataCal[i][GY] = cc[i].G_ISM[3]*tmp[GX] + cc[i].G_ISM[4]*tmp[GY] + cc[i].G_ISM[5]*tmp[GZ];
-			dataCal[i][GZ] = cc[i].G_ISM[6]*tmp[GX] + cc[i].G_ISM[7]*tmp[GY] + cc[i].G_ISM[8]*tmp[GZ];
+	if(count == 0) {
+		return;
+	}
+
+	// Every sensor has the same number of samples, so Welford's update only needs one divide
+	noise.n += 1;
+	float invN = 1 / noise.n;
+
+	for(i = 0; i < NUM_IMU_VALUES; i++) {
+		// Residuals are taken from the equally weighted mean of the array. Using the weighted
+		// estimate instead would let a heavily weighted sensor pull the reference towards
+		// itself and keep increasing its own weight.
+		float mean = 0;
+		enable = GetIMUEnableVector();
+		for(s = 0; s < NUM_SENSORS; s++, enable >>= 1) {
+			if(enable & 0x01) {
+				mean += dataCal[j][i][s];
+			}
+		}
+		mean /= (float)count;
+
+		enable = GetIMUEnableVector();
+		for(s = 0; s < NUM_SENSORS; s++, enable >>= 1) {
+			if(enable & 0x01) {
+				float r = dataCal[j][i][s] - mean;
+				float delta = r - noise.mean[i][s];
+				noise.mean[i][s] += delta*invN;
+				noise.m2[i][s] += delta*(r - noise.mean[i][s]);
+			}
 		}
 	}
 }
 
-void AverageData() {
+void UpdateFusionWeights(void) {
 
-	uint8_t i, j = 0;
+	uint8_t i, s = 0;
+	uint32_t enable = 0;
 
-	// Average over all GX, GY, GZ, AX, AY, AZ
-	for(i = 0; i < 6; i++) {
-		dataAvgd[sampleCount][i] = 0;
-		tempAvg = 0;
-		uint8_t count = 0;
+	// Need at least two samples for a variance
+	if(noise.n < 2) {
+		return;
+	}
 
-		// Average data across all sensors
-		for(j = 0; j < NUM_SENSORS; j++) {
-			// Check to see if this sensor is enabled
-			if(IsIMUEnabled(j)) {
-				dataAvgd[sampleCount][i] += dataCal[j][i];
-				tempAvg += tempCal[j];
-				count++;
+	for(i = 0; i < NUM_IMU_VALUES; i++) {
+		float total = 0;
+
+		enable = GetIMUEnableVector();
+		for(s = 0; s < NUM_SENSORS; s++, enable >>= 1) {
+			if(enable & 0x01) {
+				// Mean-square residual, so a sensor's bias relative to the array counts
+				// against it as well as its noise
+				float mse = noise.m2[i][s]/noise.n + noise.mean[i][s]*noise.mean[i][s];
+				if(mse < NOISE_MSE_MIN) {
+					mse = NOISE_MSE_MIN;
+				}
+				fusionWeight[i][s] = 1 / mse;
+				total += fusionWeight[i][s];
+			}
+			else {
+				fusionWeight[i][s] = 0;
 			}
 		}
 
-		dataAvgd[sampleCount][i] /= (float)count;
-		tempAvg /= (float)count;
+		// Normalize so the weights of each axis add up to one
+		if(total > 0) {
+			for(s = 0; s < NUM_SENSORS; s++) {
+				fusionWeight[i][s] /= total;
+			}
+		}
 	}
 
-	// Convert degrees to radians
-	dataAvgd[sampleCount][GX] *= DEG_TO_RAD;
-	dataAvgd[sampleCount][GY] *= DEG_TO_RAD;
-	dataAvgd[sampleCount][GZ] *= DEG_TO_RAD;
-	// Convert from g's to m/s^2
-	dataAvgd[sampleCount][AX] *= GRAVITY;
-	dataAvgd[sampleCount][AY] *= GRAVITY;
-	dataAvgd[sampleCount][AZ] *= GRAVITY;
+	// Fade out old statistics so the weights follow changes in the sensor noise
+	if(noise.n >= NOISE_WINDOW) {
+		noise.n *= 0.5f;
+		for(i = 0; i < NUM_IMU_VALUES; i++) {
+			for(s = 0; s < NUM_SENSORS; s++) {
+				noise.m2[i][s] *= 0.5f;
+			}
+		}
+	}
+}
 
-	sampleCount++;
-	outputCount++;
+void UpdateStaticDetector(uint16_t j) {
+
+	uint8_t i = 0;
+	float *f = dataFused[j];
+	float *old = detector.window[detector.idx];
+
+	if(detector.fill == 0) {
+		for(i = 0; i < NUM_IMU_VALUES; i++) {
+			detector.ref[i] = f[i];
+		}
+	}
+
+	// Replace the oldest sample in the window with the newest one
+	for(i = 0; i < NUM_IMU_VALUES; i++) {
+		float x = f[i] - detector.ref[i];
+		if(detector.fill == STATIC_WINDOW) {
+			float y = old[i] - detector.ref[i];
+			detector.sum[i] -= y;
+			detector.sumSq[i] -= y*y;
+		}
+		detector.sum[i] += x;
+		detector.sumSq[i] += x*x;
+		old[i] = f[i];
+	}
+	if(detector.fill < STATIC_WINDOW) {
+		detector.fill++;
+	}
+
+	// Once per window, move the reference to the window mean. The sums are shifted along
+	// with it (S2 - d*S1, 0), no need to go through the window again.
+	if(++detector.idx >= STATIC_WINDOW) {
+		detector.idx = 0;
+		for(i = 0; i < NUM_IMU_VALUES; i++) {
+			float d = detector.sum[i] / STATIC_WINDOW;
+			detector.sumSq[i] -= d*detector.sum[i];
+			// Round-off can take the sum of squares slightly negative
+			if(detector.sumSq[i] < 0) {
+				detector.sumSq[i] = 0;
+			}
+			detector.ref[i] += d;
+			detector.sum[i] = 0;
+		}
+	}
+
+	if(detector.fill < STATIC_WINDOW) {
+		detector.isStatic = false;
+		return;
+	}
+
+	// Variance and mean of the window
+	float var[NUM_IMU_VALUES], mean[NUM_IMU_VALUES];
+	for(i = 0; i < NUM_IMU_VALUES; i++) {
+		float m = detector.sum[i] / STATIC_WINDOW;
+		var[i] = detector.sumSq[i] / STATIC_WINDOW - m*m;
+		mean[i] = detector.ref[i] + m;
+	}
+
+	float g = sqrtf(mean[AX]*mean[AX] + mean[AY]*mean[AY] + mean[AZ]*mean[AZ]);
+	detector.isStatic = ((var[AX] + var[AY] + var[AZ]) < STATIC_ACC_VAR) &&
+			((var[GX] + var[GY] + var[GZ]) < STATIC_GYRO_VAR) &&
+			(fabsf(g - GRAVITY) < STATIC_ACC_TOL) &&
+			(fabsf(mean[GX]) < STATIC_GYRO_MAX) &&
+			(fabsf(mean[GY]) < STATIC_GYRO_MAX) &&
+			(fabsf(mean[GZ]) < STATIC_GYRO_MAX);
+}
+
+// True while a heading alignment is averaging or waiting to be applied. The gyro bias
+// estimator is held in the meantime, so the rate it averages keeps a fixed correction.
+bool IsHeadingAlignmentActive() {
+	return align.heading &&
+			((align.phase == ALIGN_STAT_AVERAGING) || (align.phase == ALIGN_STAT_PENDING));
+}
+
+void UpdateGyroBias(uint16_t j, uint8_t count) {
+
+	uint8_t i, s = 0;
+	uint32_t enable = 0;
+
+	if(count == 0) {
+		return;
+	}
+
+	// While static, the calibrated angular rate of each sensor is its remaining bias.
+	// Moving the estimate a fraction of the way towards zero rate each sample gives an
+	// exponential average of the bias. Adding the same step to the offset used by the
+	// calibration applies it from the next record on, without recomputing the
+	// temperature compensation. The total correction of each sensor is limited to
+	// GYRO_BIAS_MAX.
+	for(i = 0; i < 3; i++) {
+		float sum = 0;
+
+		enable = GetIMUEnableVector();
+		for(s = 0; s < NUM_SENSORS; s++, enable >>= 1) {
+			if(enable & 0x01) {
+				float step = GYRO_BIAS_ALPHA*dataCal[j][GX + i][s];
+				if(gyroBias.sensor[i][s] + step > GYRO_BIAS_MAX) {
+					step = GYRO_BIAS_MAX - gyroBias.sensor[i][s];
+				}
+				else if(gyroBias.sensor[i][s] + step < -GYRO_BIAS_MAX) {
+					step = -GYRO_BIAS_MAX - gyroBias.sensor[i][s];
+				}
+				gyroBias.sensor[i][s] += step;
+				tempComp.offset[GX + i][s] += step;
+				tempComp.offset[GX + i][NUM_SENSORS + s/GROUP_SIZE] += step / GROUP_SIZE;
+				sum += step;
+			}
+		}
+		gyroBias.array[i] += sum / count;
+	}
+	gyroBias.samples++;
+}
+
+// Returns the averaged sample taken 'n' samples before the newest one
+float* PreviousSample(uint8_t n) {
+	return dataAvgd[(sampleIdx - n) & (SAMPLE_WINDOW - 1)];
+}
+
+void ComputeIncrements() {
+
+	float *samples[INTEGRATION_MAX_POINTS];
+	uint8_t p = 0;
+
+	// Fall back to a lower order rule until enough samples have been collected
+	uint8_t rule = GetIntegrationRule();
+	while((rule > INTEGRATION_TRAPEZOID) && (sampleFill < IntegrationRulePoints(rule))) {
+		rule--;
+	}
+
+	for(p = 0; p < IntegrationRulePoints(rule); p++) {
+		samples[p] = PreviousSample(p);
+	}
+	IntegrateSamples(rule, samples, Ts, dVInc[incCount], dThetaInc[incCount]);
+	incCount++;
 }
 
 void IntegrateGyroData() {
-	float qProp[4] = {0};   // Propagated attitude quaternion
-
-	// Integrate gyro output using Simpson's rule to get the delta theta
-	dTheta[X] = (Ts/3)*(dataAvgd[2][GX] + 4*dataAvgd[1][GX] + dataAvgd[0][GX]);
-	dTheta[Y] = (Ts/3)*(dataAvgd[2][GY] + 4*dataAvgd[1][GY] + dataAvgd[0][GY]);
-	dTheta[Z] = (Ts/3)*(dataAvgd[2][GZ] + 4*dataAvgd[1][GZ] + dataAvgd[0][GZ]);
-
-	// Compute norm of delta theta
-	float phi_sq = dTheta[X]*dTheta[X] + dTheta[Y]*dTheta[Y] + dTheta[Z]*dTheta[Z];
-
-	// Convert to quaternion representation
-	if(phi_sq > 1E-12) {
-	    // Approximate cosine by Taylor series up to 2nd order terms
-		q1[0] = 1 - 0.125*phi_sq;
-
-	    // Approximate sine by Taylor series up to 2nd order terms
-		float a = 0.5 - phi_sq/48.0;
-		q1[1] = dTheta[X]*a;
-		q1[2] = dTheta[Y]*a;
-		q1[3] = dTheta[Z]*a;
-	}
-
-	// Propagate the attitude quaternion
-	qProp[0] = q[0]*q1[0] - q[1]*q1[1] - q[2]*q1[2] - q[3]*q1[3];
-	qProp[1] = q[0]*q1[1] + q[1]*q1[0] + q[2]*q1[3] - q[3]*q1[2];
-	qProp[2] = q[0]*q1[2] - q[1]*q1[3] + q[2]*q1[0] + q[3]*q1[1];
-	qProp[3] = q[0]*q1[3] + q[1]*q1[2] - q[2]*q1[1] + q[3]*q1[0];
-
-	// Normalize the quaternion
-	float qPropNorm = sqrt(qProp[0]*qProp[0] + qProp[1]*qProp[1] + qProp[2]*qProp[2] + qProp[3]*qProp[3]);
-	q[0] = qProp[0]/qPropNorm;
-	q[1] = qProp[1]/qPropNorm;
-	q[2] = qProp[2]/qPropNorm;
-	q[3] = qProp[3]/qPropNorm;
-
-	// Store latest delta thetas
-	processedData.dTheta[X] = dTheta[X];
-	processedData.dTheta[Y] = dTheta[Y];
-	processedData.dTheta[Z] = dTheta[Z];
+	float *w = PreviousSample(0);
+
+	// Rotate the attitude by the rotation vector of the update interval
+	stats.quatNormError = PropagateQuaternion(q, dTheta, QUAT_RENORM_INTERVAL, &renormCount);
+
+	// Rotation matrix of the new attitude, used to rotate the next velocity increment
+	ComputeRotationMatrix(q, Cbn);
+
+	// Accumulate the delta thetas over the output period
+	processedData.dTheta[X] += dTheta[X];
+	processedData.dTheta[Y] += dTheta[Y];
+	processedData.dTheta[Z] += dTheta[Z];
 
 	// Store attitude quaternion
 	processedData.Q[X] = q[1];
@@ -668,53 +1308,44 @@ void IntegrateGyroData() {
 	processedData.Q[W] = q[0];
 
 	// Store latest angular velocity
-	processedData.angVel[X] = dataAvgd[2][GX];
-	processedData.angVel[Y] = dataAvgd[2][GY];
-	processedData.angVel[Z] = dataAvgd[2][GZ];
+	processedData.angVel[X] = w[GX];
+	processedData.angVel[Y] = w[GY];
+	processedData.angVel[Z] = w[GZ];
 
 	processedData.avgTemp = tempAvg;
 }
 
 void IntegrateAccelerometerData() {
 	float w[3] = {0};   // dV reprsented in inertial frame
+	float *f = PreviousSample(0);
 
-	// Integrate accelerometer output using Simpson's rule
-	dV[X] = (Ts/3)*(dataAvgd[2][AX] + 4*dataAvgd[1][AX] + dataAvgd[0][AX]);
-	dV[Y] = (Ts/3)*(dataAvgd[2][AY] + 4*dataAvgd[1][AY] + dataAvgd[0][AY]);
-	dV[Z] = (Ts/3)*(dataAvgd[2][AZ] + 4*dataAvgd[1][AZ] + dataAvgd[0][AZ]);
-
-	// Transform accelerations to inertial frame (w = qvq*
-	w[X] = 2*(dV[X]*(q1[0]*q1[0] + q1[1]*q1[1] - 0.5) +
-		      dV[Y]*(q1[1]*q1[2] - q1[0]*q1[3]) +
-			  dV[Z]*(q1[1]*q1[3] + q1[0]*q1[2]));
-
-	w[Y] = 2*(dV[X]*(q1[1]*q1[2] + q1[0]*q1[3]) +
-			  dV[Y]*(q1[0]*q1[0] + q1[2]*q1[2] - 0.5) +
-			  dV[Z]*(q1[2]*q1[3] - q1[0]*q1[1]));
+	// Transform the velocity increment to the navigation frame using the attitude at the
+	// start of the update interval (sculling and rotation are compensated in the body frame)
+	RotateVector(Cbn, dV, w);
 
-	w[Z] = 2*(dV[X]*(q1[1]*q1[3] - q1[0]*q1[2]) +
-			  dV[Y]*(q1[2]*q1[3] + q1[0]*q1[1]) +
-			  dV[Z]*(q1[0]*q1[0] + q1[3]*q1[3] - 0.5));
+	dVNav[X] = w[X];
+	dVNav[Y] = w[Y];
+	dVNav[Z] = w[Z];
 
 	// Accumulate the velocity
-	accVel[X] += w[X];
-	accVel[Y] += w[Y];
-	accVel[Z] += w[Z];
+	CompensatedAdd(&accVel[X], w[X]);
+	CompensatedAdd(&accVel[Y], w[Y]);
+	CompensatedAdd(&accVel[Z], w[Z]);
 
 	// Store quaternion in processed data
-	processedData.dV[X] = dV[X];
-	processedData.dV[Y] = dV[Y];
-	processedData.dV[Z] = dV[Z];
+	processedData.dV[X] += dV[X];
+	processedData.dV[Y] += dV[Y];
+	processedData.dV[Z] += dV[Z];
 
 	// Store accumulated velocity
-	processedData.accumV[X] = accVel[X];
-	processedData.accumV[Y] = accVel[Y];
-	processedData.accumV[Z] = accVel[Z];
+	processedData.accumV[X] = CompensatedValue(&accVel[X]);
+	processedData.accumV[Y] = CompensatedValue(&accVel[Y]);
+	processedData.accumV[Z] = CompensatedValue(&accVel[Z]);
 
 	// Store latest specific force
-	processedData.specificForce[X] = dataAvgd[2][AX];
-	processedData.specificForce[Y] = dataAvgd[2][AY];
-	processedData.specificForce[Z] = dataAvgd[2][AZ];
+	processedData.specificForce[X] = f[AX];
+	processedData.specificForce[Y] = f[AY];
+	processedData.specificForce[Z] = f[AZ];
 }
 
 // *******************************************************************************
@@ -722,37 +1353,435 @@ void IntegrateAccelerometerData() {
 // *******************************************************************************
 
 
-void WriteDataToRegisters(uint32_t recordTimeStamp) {
-	// TODO: Change dTheta and dV to accelerometer and angular velocity output
+void CommitNavigationConfig() {
+	// Runs in the I2C interrupt, so the processing never sees part of a write
+	navConfig = navConfigWrite;
+}
 
-	RegWriteFloat32(REG_DELTA_THETA_X_1, processedData.dTheta[X]);
-	RegWriteFloat32(REG_DELTA_THETA_Y_1, processedData.dTheta[Y]);
-	RegWriteFloat32(REG_DELTA_THETA_Z_1, processedData.dTheta[Z]);
+float LocalGravity() {
 
-	RegWriteFloat32(REG_DELTA_VEL_X_1, processedData.dV[X]);
-	RegWriteFloat32(REG_DELTA_VEL_Y_1, processedData.dV[Y]);
-	RegWriteFloat32(REG_DELTA_VEL_Z_1, processedData.dV[Z]);
+	static float gravity = GRAVITY;
+	static float latitude = 0, height = 0;
+	static bool valid = false;
+
+	// Gravity, latitude and height of the same write of the master
+	ROM_IntMasterDisable();
+	struct NavigationConfig cfg = navConfig;
+	ROM_IntMasterEnable();
 
-	RegWriteFloat32(REG_IQUAT_X_1, processedData.Q[X]);
-	RegWriteFloat32(REG_IQUAT_Y_1, processedData.Q[Y]);
-	RegWriteFloat32(REG_IQUAT_Z_1, processedData.Q[Z]);
-	RegWriteFloat32(REG_IQUAT_W_1, processedData.Q[W]);
+	if(cfg.gravity > 0) {
+		return cfg.gravity;
+	}
 
-	RegWriteFloat32(REG_TEMP_1, processedData.avgTemp);
+	// Only evaluate the gravity model when the master changes the location
+	if(!valid || (cfg.latitude != latitude) || (cfg.height != height)) {
+		latitude = cfg.latitude;
+		height = cfg.height;
+		float sinLat = sinf(latitude*DEG_TO_RAD);
+		float sin2 = sinLat*sinLat;
+		gravity = WGS84_GRAVITY_EQUATOR*(1 + WGS84_GRAVITY_K*sin2) / sqrtf(1 - WGS84_E2*sin2);
+		gravity -= FREE_AIR_GRADIENT*height;
+		valid = true;
+	}
 
-	RegWriteFloat32(REG_ACC_VEL_X_1, processedData.accumV[X]);
-	RegWriteFloat32(REG_ACC_VEL_Y_1, processedData.accumV[Y]);
-	RegWriteFloat32(REG_ACC_VEL_Z_1, processedData.accumV[Z]);
+	return gravity;
+}
 
-	RegWriteUInt32(REG_TICK_1, recordTimeStamp);
+void UpdateNavigation(float dt) {
+	uint8_t i = 0;
+	float g[3] = {0, 0, -LocalGravity()*dt};
 
-	RegWriteFloat32(REG_ANG_VEL_X_1, processedData.angVel[X]);
-	RegWriteFloat32(REG_ANG_VEL_Y_1, processedData.angVel[Y]);
-	RegWriteFloat32(REG_ANG_VEL_Z_1, processedData.angVel[Z]);
+	for(i = 0; i < 3; i++) {
+		float velPrev = CompensatedValue(&vel[i]);
 
-	RegWriteFloat32(REG_SP_FORCE_X_1, processedData.specificForce[X]);
-	RegWriteFloat32(REG_SP_FORCE_Y_1, processedData.specificForce[Y]);
-	RegWriteFloat32(REG_SP_FORCE_Z_1, processedData.specificForce[Z]);
+		// Velocity: specific force increment plus the gravity over the update interval
+		// (gravity points down the Z axis of the navigation frame)
+		CompensatedAdd(&vel[i], dVNav[i] + g[i]);
+		processedData.vel[i] = CompensatedValue(&vel[i]);
+
+		// Position: trapezoidal integration of the velocity
+		CompensatedAdd(&pos[i], 0.5f*dt*(velPrev + processedData.vel[i]));
+		processedData.pos[i] = CompensatedValue(&pos[i]);
+	}
+}
+
+void UpdateZUPTDetector(uint16_t j) {
+	float *f = dataFused[j];
+	float *old = zupt.window[zupt.idx];
+	uint8_t i = 0;
+
+	if(zupt.fill == 0) {
+		zupt.ref[X] = f[AX];
+		zupt.ref[Y] = f[AY];
+		zupt.ref[Z] = f[AZ];
+	}
+
+	// Take the oldest sample out of the sums
+	if(zupt.fill == ZUPT_WINDOW) {
+		float x[3] = {old[X] - zupt.ref[X], old[Y] - zupt.ref[Y], old[Z] - zupt.ref[Z]};
+		for(i = 0; i < 3; i++) {
+			zupt.sumAcc[i] -= x[i];
+		}
+		zupt.sumAccSq -= x[X]*x[X] + x[Y]*x[Y] + x[Z]*x[Z];
+		zupt.sumGyroSq -= old[3];
+	}
+	else {
+		zupt.fill++;
+	}
+
+	// Put the newest one in its place
+	old[X] = f[AX];
+	old[Y] = f[AY];
+	old[Z] = f[AZ];
+	old[3] = f[GX]*f[GX] + f[GY]*f[GY] + f[GZ]*f[GZ];
+	float x[3] = {old[X] - zupt.ref[X], old[Y] - zupt.ref[Y], old[Z] - zupt.ref[Z]};
+	for(i = 0; i < 3; i++) {
+		zupt.sumAcc[i] += x[i];
+	}
+	zupt.sumAccSq += x[X]*x[X] + x[Y]*x[Y] + x[Z]*x[Z];
+	zupt.sumGyroSq += old[3];
+
+	// Once per window, move the reference to the window mean. The sums are shifted along
+	// with it (S2 - 2*d.S1 + n*|d|^2, S1 - n*d), no need to go through the window again.
+	zupt.idx = (zupt.idx + 1) & (ZUPT_WINDOW - 1);
+	if(zupt.idx == 0) {
+		float n = zupt.fill;
+		float d[3] = {zupt.sumAcc[X]/n, zupt.sumAcc[Y]/n, zupt.sumAcc[Z]/n};
+		zupt.sumAccSq -= d[X]*zupt.sumAcc[X] + d[Y]*zupt.sumAcc[Y] + d[Z]*zupt.sumAcc[Z];
+		for(i = 0; i < 3; i++) {
+			zupt.ref[i] += d[i];
+			zupt.sumAcc[i] = 0;
+		}
+	}
+	// Round-off can take the sums of squares slightly negative
+	if(zupt.sumAccSq < 0) {
+		zupt.sumAccSq = 0;
+	}
+	if(zupt.sumGyroSq < 0) {
+		zupt.sumGyroSq = 0;
+	}
+
+	if(zupt.fill < ZUPT_WINDOW) {
+		zupt.isStationary = false;
+		return;
+	}
+
+	// Test statistic: sum over the window of |f - g*m/|m||^2/sigma_a^2 + |w|^2/sigma_w^2,
+	// with m the mean specific force. The specific force term is the scatter about the mean
+	// plus the difference between the magnitude of the mean and gravity.
+	const float n = ZUPT_WINDOW;
+	float m[3] = {zupt.sumAcc[X]/n, zupt.sumAcc[Y]/n, zupt.sumAcc[Z]/n};
+	float scatter = zupt.sumAccSq - n*(m[X]*m[X] + m[Y]*m[Y] + m[Z]*m[Z]);
+	m[X] += zupt.ref[X];
+	m[Y] += zupt.ref[Y];
+	m[Z] += zupt.ref[Z];
+	float dg = sqrtf(m[X]*m[X] + m[Y]*m[Y] + m[Z]*m[Z]) - LocalGravity();
+	zupt.statistic = ((scatter + n*dg*dg)*(1/(ZUPT_ACC_SIGMA*ZUPT_ACC_SIGMA)) +
+			zupt.sumGyroSq*(1/(ZUPT_GYRO_SIGMA*ZUPT_GYRO_SIGMA))) / n;
+	zupt.isStationary = (zupt.statistic < navConfig.zuptThreshold);
+}
+
+// Resets the velocities while the body is stationary
+void ApplyZeroVelocityUpdate() {
+	uint8_t i = 0;
+
+	for(i = 0; i < 3; i++) {
+		vel[i].sum = 0;
+		vel[i].c = 0;
+		accVel[i].sum = 0;
+		accVel[i].c = 0;
+		processedData.vel[i] = 0;
+		processedData.accumV[i] = 0;
+	}
+	stats.zuptCount++;
+}
+
+// Sets the step of the alignment and reports it to the master
+void SetAlignmentPhase(uint8_t phase) {
+	align.phase = phase;
+
+	// The master may be writing a command to the same register
+	ROM_IntMasterDisable();
+	SetAlignStatus(phase);
+	ROM_IntMasterEnable();
+}
+
+void AlignmentTask() {
+
+	uint8_t i = 0;
+
+	// Interrupts are disabled so a command written while the previous one is being
+	// cleared is not lost
+	ROM_IntMasterDisable();
+	uint8_t cmd = GetAlignCommand();
+	ClearAlignCommand();
+	ROM_IntMasterEnable();
+
+	switch(cmd) {
+		case ALIGN_CMD_NONE:
+			break;
+		// (Re)start averaging, acquisition keeps running in the meantime
+		case ALIGN_CMD_LEVEL:
+		case ALIGN_CMD_HEADING:
+			align.heading = (cmd == ALIGN_CMD_HEADING);
+			align.count = 0;
+			for(i = 0; i < 3; i++) {
+				align.acc[i].sum = 0;
+				align.acc[i].c = 0;
+				align.gyro[i].sum = 0;
+				align.gyro[i].c = 0;
+			}
+			SetAlignmentPhase(ALIGN_STAT_AVERAGING);
+			break;
+		case ALIGN_CMD_ABORT:
+			SetAlignmentPhase(ALIGN_STAT_IDLE);
+			break;
+		default:
+			SetAlignmentPhase(ALIGN_STAT_INVALID);
+			break;
+	}
+}
+
+// Adds the fused data of record 'j' of the current batch to the alignment sums
+void AccumulateAlignment(uint16_t j) {
+	uint8_t i = 0;
+
+	for(i = 0; i < 3; i++) {
+		CompensatedAdd(&align.acc[i], dataFused[j][AX + i]);
+		CompensatedAdd(&align.gyro[i], dataFused[j][GX + i]);
+	}
+
+	if(++align.count >= navConfig.alignSamples) {
+		SetAlignmentPhase(ALIGN_STAT_PENDING);
+	}
+}
+
+// Seeds the attitude with the averaged data. Called at the end of an output frame, so
+// every output frame is integrated from a single attitude.
+void ApplyAlignment() {
+	uint8_t i = 0;
+	float f[3], w[3];
+
+	for(i = 0; i < 3; i++) {
+		f[i] = CompensatedValue(&align.acc[i]) / align.count;
+		w[i] = CompensatedValue(&align.gyro[i]) / align.count;
+	}
+
+	// Without a specific force there is nothing to level to
+	float fNorm = sqrtf(f[X]*f[X] + f[Y]*f[Y] + f[Z]*f[Z]);
+	if(fNorm < STATIC_ACC_TOL) {
+		SetAlignmentPhase(ALIGN_STAT_INVALID);
+		return;
+	}
+
+	// Roll and pitch that turn the specific force (up) onto the Z axis
+	float roll = atan2f(f[Y], f[Z]);
+	float pitch = atan2f(-f[X], sqrtf(f[Y]*f[Y] + f[Z]*f[Z]));
+
+	// Coarse heading: the horizontal part of the Earth rate in the levelled frame points
+	// north, which becomes the X axis of the navigation frame. Otherwise the heading of
+	// the body is kept. The gyro bias estimator takes every static rate for bias, the
+	// Earth rate included, so its correction is added back first.
+	float yaw = 0;
+	if(align.heading) {
+		for(i = 0; i < 3; i++) {
+			w[i] += DEG_TO_RAD*gyroBias.array[i];
+		}
+		float sr = sinf(roll), cr = cosf(roll);
+		float sp = sinf(pitch), cp = cosf(pitch);
+		float wNorth = cp*w[X] + sp*sr*w[Y] + sp*cr*w[Z];
+		float wWest = cr*w[Y] - sr*w[Z];
+		yaw = -atan2f(wWest, wNorth);
+	}
+
+	// Quaternion of the Z-Y-X rotation
+	float sr = sinf(0.5f*roll), cr = cosf(0.5f*roll);
+	float sp = sinf(0.5f*pitch), cp = cosf(0.5f*pitch);
+	float sy = sinf(0.5f*yaw), cy = cosf(0.5f*yaw);
+	q[0] = cr*cp*cy + sr*sp*sy;
+	q[1] = sr*cp*cy - cr*sp*sy;
+	q[2] = cr*sp*cy + sr*cp*sy;
+	q[3] = cr*cp*sy - sr*sp*cy;
+	ComputeRotationMatrix(q, Cbn);
+
+	// Restart everything that depends on the navigation frame
+	for(i = 0; i < 4; i++) {
+		attFilter.q[i] = q[i];
+	}
+	for(i = 0; i < 3; i++) {
+		attFilter.wInt[i] = 0;
+		accVel[i].sum = 0;
+		accVel[i].c = 0;
+		vel[i].sum = 0;
+		vel[i].c = 0;
+		pos[i].sum = 0;
+		pos[i].c = 0;
+	}
+	EKFReset(q);
+
+	processedData.Q[X] = q[1];
+	processedData.Q[Y] = q[2];
+	processedData.Q[Z] = q[3];
+	processedData.Q[W] = q[0];
+
+	SetAlignmentPhase(ALIGN_STAT_DONE);
+}
+
+void UpdateAttitudeFilter() {
+	float *f = PreviousSample(0);
+	float *qf = attFilter.q;
+	uint8_t i = 0;
+
+	// While disabled, follow the integrated attitude so the filter starts from it
+	if(!IsAttitudeFilterEnabled()) {
+		for(i = 0; i < 4; i++) {
+			qf[i] = q[i];
+		}
+		attFilter.wInt[X] = 0;
+		attFilter.wInt[Y] = 0;
+		attFilter.wInt[Z] = 0;
+		return;
+	}
+
+	uint32_t startCycles = CYCLE_COUNT();
+	float w[3] = {f[GX], f[GY], f[GZ]};
+
+	// Use the specific force as the direction of gravity, unless the body is accelerating
+	float aNormSq = f[AX]*f[AX] + f[AY]*f[AY] + f[AZ]*f[AZ];
+	float g = LocalGravity();
+	float aNorm = sqrtf(aNormSq);
+	if(fabsf(aNorm - g) < ATT_FILTER_ACC_GATE*g) {
+		float invNorm = 1 / aNorm;
+		float a[3] = {f[AX]*invNorm, f[AY]*invNorm, f[AZ]*invNorm};
+
+		// Direction of gravity (up) in the body frame according to the filter's attitude
+		float v[3];
+		v[X] = 2*(qf[1]*qf[3] - qf[0]*qf[2]);
+		v[Y] = 2*(qf[2]*qf[3] + qf[0]*qf[1]);
+		v[Z] = 1 - 2*(qf[1]*qf[1] + qf[2]*qf[2]);
+
+		// Error between the measured and estimated direction, fed back as a rate correction
+		float e[3];
+		e[X] = a[Y]*v[Z] - a[Z]*v[Y];
+		e[Y] = a[Z]*v[X] - a[X]*v[Z];
+		e[Z] = a[X]*v[Y] - a[Y]*v[X];
+
+		for(i = 0; i < 3; i++) {
+			attFilter.wInt[i] += filterConfig.ki*Ts*e[i];
+			w[i] += filterConfig.kp*e[i] + attFilter.wInt[i];
+		}
+	}
+
+	// Propagate the attitude over one sample interval (first order)
+	float h = 0.5f*Ts;
+	float a0 = qf[0], a1 = qf[1], a2 = qf[2], a3 = qf[3];
+	qf[0] += h*(-a1*w[X] - a2*w[Y] - a3*w[Z]);
+	qf[1] += h*( a0*w[X] + a2*w[Z] - a3*w[Y]);
+	qf[2] += h*( a0*w[Y] - a1*w[Z] + a3*w[X]);
+	qf[3] += h*( a0*w[Z] + a1*w[Y] - a2*w[X]);
+
+	float k = 1 / sqrtf(qf[0]*qf[0] + qf[1]*qf[1] + qf[2]*qf[2] + qf[3]*qf[3]);
+	for(i = 0; i < 4; i++) {
+		qf[i] *= k;
+	}
+
+	stats.filterCycles = CYCLE_COUNT() - startCycles;
+}
+
+// Computes the derived attitude representations if the output attitude has changed since
+// they were last computed. Called from the I2C interrupt when PAGE_ATTITUDE is read.
+void UpdateDerivedAttitude() {
+	if(!derivedStale) {
+		return;
+	}
+	derivedStale = false;
+
+	uint32_t startCycles = CYCLE_COUNT();
+	struct DerivedAttitude next;
+	float *qd = derivedQ;
+	float *C = next.dcm;
+
+	ComputeRotationMatrix(qd, C);
+
+	// Clamp the pitch sine, rounding can take it slightly past one at +/-90 deg
+	float sinPitch = -C[6];
+	if(sinPitch > 1) {
+		sinPitch = 1;
+	}
+	else if(sinPitch < -1) {
+		sinPitch = -1;
+	}
+	next.euler[X] = atan2f(C[7], C[8]);
+	next.euler[Y] = asinf(sinPitch);
+	next.euler[Z] = atan2f(C[3], C[0]);
+
+	// Rotation vector of the shortest rotation (scalar part made positive)
+	float s = (qd[0] < 0) ? -1.0f : 1.0f;
+	float vNorm = sqrtf(qd[1]*qd[1] + qd[2]*qd[2] + qd[3]*qd[3]);
+	float k = (vNorm > 1E-6f) ? 2*s*atan2f(vNorm, s*qd[0])/vNorm : 2*s;
+	next.rotVec[X] = k*qd[1];
+	next.rotVec[Y] = k*qd[2];
+	next.rotVec[Z] = k*qd[3];
+
+	next.timeStamp = derivedTimeStamp;
+
+	// When called from the main loop, the I2C interrupt must not read the page half-written.
+	// Only the copy is protected, interrupts are enabled again as they are in the interrupt.
+	ROM_IntMasterDisable();
+	derivedAtt = next;
+	ROM_IntMasterEnable();
+
+	stats.derivedCycles = CYCLE_COUNT() - startCycles;
+	stats.derivedCount++;
+}
+
+// Fills the output registers 'out' with the current output
+void FillOutputRegisters(struct OutputRegisters *out, uint32_t recordTimeStamp) {
+	memcpy(out->dTheta, processedData.dTheta, sizeof(out->dTheta));
+	memcpy(out->dV, processedData.dV, sizeof(out->dV));
+	memcpy(out->Q, processedData.Q, sizeof(out->Q));
+	out->temp = processedData.avgTemp;
+	memcpy(out->accumV, processedData.accumV, sizeof(out->accumV));
+	out->tick = recordTimeStamp;
+	memcpy(out->angVel, processedData.angVel, sizeof(out->angVel));
+	memcpy(out->specificForce, processedData.specificForce, sizeof(out->specificForce));
+	memcpy(out->filterQ, processedData.filterQ, sizeof(out->filterQ));
+}
+
+// Adds the current output to the register FIFO
+void QueueOutputRecord(uint32_t recordTimeStamp) {
+	struct OutputRegisters record;
+
+	FillOutputRegisters(&record, recordTimeStamp);
+	if(!RegPushRecord(&record)) {
+		stats.fifoOverflows++;
+	}
+}
+
+void WriteDataToRegisters(uint32_t recordTimeStamp) {
+	// TODO: Change dTheta and dV to accelerometer and angular velocity output
+
+	FillOutputRegisters(RegOutputBuffer(), recordTimeStamp);
+	RegPublishOutput();
+
+	memcpy(navOutput.vel, processedData.vel, sizeof(navOutput.vel));
+	memcpy(navOutput.pos, processedData.pos, sizeof(navOutput.pos));
+	navOutput.gravity = LocalGravity();
+
+	// Hand the attitude over to the derived representations. The flag is cleared first so
+	// an interrupt in between keeps serving the previous, consistent values.
+	derivedStale = false;
+	derivedQ[0] = processedData.Q[W];
+	derivedQ[1] = processedData.Q[X];
+	derivedQ[2] = processedData.Q[Y];
+	derivedQ[3] = processedData.Q[Z];
+	derivedTimeStamp = recordTimeStamp;
+	derivedStale = true;
+
+	// Subscribers get them every output period
+	if(IsAttitudeSubscribed()) {
+		UpdateDerivedAttitude();
+	}
 }
 
 void WriteRawDataToSDCard(uint16_t k) {
@@ -780,6 +1809,7 @@ void WriteCalibratedDataToSDCard() {
 
 	// Encode the calibrated data
 	COBSStuffData((char*)(&processedData.dTheta[X]), &calEncodedData[0], CAL_PKT_SIZE);
+	COBSStuffData((char*)(&processedData.vel[X]), &calEncodedData[CAL_PKT_SIZE], NAV_PKT_SIZE);
 
 	uint16_t i = 0;
 	for(i = 0; i < sizeof(calEncodedData); i++) {
@@ -794,50 +1824,270 @@ void WriteCalibratedDataToSDCard() {
 	}
 }
 
-void ProcessDataRecord(uint16_t k) {
+void UpdateAttitude() {
+	uint32_t startCycles = CYCLE_COUNT();
+
+	ConingSculling(dThetaInc, dVInc, incCount, dTheta, dV);
+	// Velocity first, it needs the attitude at the start of the interval
+	IntegrateAccelerometerData();
+	IntegrateGyroData();
+	UpdateNavigation(incCount*Ts);
+
+	stats.attitudeCycles = CYCLE_COUNT() - startCycles;
+
+	// While disabled, the Kalman filter is held at the integrated attitude so it starts from it
+	if(IsEKFEnabled()) {
+		startCycles = CYCLE_COUNT();
+		EKFStep(dTheta, incCount*Ts, PreviousSample(0), LocalGravity());
+		stats.ekfCycles = CYCLE_COUNT() - startCycles;
+	}
+	else {
+		EKFReset(q);
+	}
+	incCount = 0;
+}
+
+// Processes the queue record at index 'k', which was calibrated as record 'j' of the current batch
+void ProcessDataRecord(uint16_t k, uint16_t j, uint8_t count, bool sensorDataStored) {
 
 	// Get the timestamp for this data record
 	uint32_t recordTimeStamp = queue[k].timeStamp;
+	if(recordsAhead > 0) {
+		recordsAhead--;
+	}
 
-	// Calibrate the data record
-	CalibrateData(k);
-	// Averaged the calibrated data
- 	AverageData();
+	// Add the averaged data to the integration window, replacing the oldest sample
+	uint8_t i = 0;
+	sampleIdx = (sampleIdx + 1) & (SAMPLE_WINDOW - 1);
+	for(i = 0; i < NUM_IMU_VALUES; i++) {
+		dataAvgd[sampleIdx][i] = dataFused[j][i];
+	}
+	if(sampleFill < SAMPLE_WINDOW) {
+		sampleFill++;
+	}
+	tempAvg = tempFused[j];
+	outputCount++;
+
+	// Look for static intervals and use them to track the gyro bias. The bias estimate needs
+	// the data of each sensor, which is only kept once the detector has reported a static
+	// interval, so estimation starts one batch later.
+	UpdateStaticDetector(j);
+	SetStatusFlag(STAT_STATIC_MASK, detector.isStatic);
+	if(detector.isStatic && sensorDataStored && IsBiasEstimationEnabled() &&
+			!IsHeadingAlignmentActive()) {
+		UpdateGyroBias(j, count);
+	}
 
 	// ... otherwise we are in experimental modes, write the data to the SD card
 	if(GetIMUMode() == MODE_SD_WRITE) {
 		WriteRawDataToSDCard(k);
 	}
 
-	// Need three samples to do integration
-	if(sampleCount == 3) {
-		sampleCount = 1;
+	// Drift-corrected attitude, updated at the full sample rate
+	UpdateAttitudeFilter();
 
-		IntegrateGyroData();
-		IntegrateAccelerometerData();
+	// Need two samples to integrate over a sample interval. The attitude is updated
+	// once the number of intervals selected for the coning compensation is reached.
+	if(sampleFill >= 2) {
+		ComputeIncrements();
 
-		// Place last sample in front now
-		uint8_t i = 0;
-		for(i = 0; i < 6; i++) {
-			dataAvgd[0][i] = dataAvgd[2][i];
+		if(incCount >= GetConingSamples()) {
+			UpdateAttitude();
 		}
 	}
 
+	if(align.phase == ALIGN_STAT_AVERAGING) {
+		AccumulateAlignment(j);
+	}
+
+	// Zero-velocity updates, after the integration so the velocity it just added is removed
+	UpdateZUPTDetector(j);
+	SetStatusFlag(STAT_ZUPT_MASK, zupt.isStationary);
+	if(zupt.isStationary) {
+		ApplyZeroVelocityUpdate();
+	}
+
 	// Output if ready
 	if(outputCount >= GetOutputRateDivider()) {
 		outputCount = 0;
 
-		// Write data to I2C registers if in nominal mode
+		// Fold in the increments since the last attitude update, so the output covers the
+		// whole output period
+		if(incCount > 0) {
+			UpdateAttitude();
+		}
+
+		// Refresh the fusion weights once per output period, off the per-sample path
+		if(GetFusionMode() == FUSION_WEIGHTED) {
+			UpdateFusionWeights();
+		}
+
+		processedData.filterQ[X] = attFilter.q[1];
+		processedData.filterQ[Y] = attFilter.q[2];
+		processedData.filterQ[Z] = attFilter.q[3];
+		processedData.filterQ[W] = attFilter.q[0];
+
+		// Write data to I2C registers if in nominal mode. Every output goes into the FIFO
+		// once the master uses it, but while catching up only the last output of the
+		// backlog is written to the registers, the master could not read the others there
+		// in time.
 		if(GetIMUMode() == MODE_STREAMING) {
-			WriteDataToRegisters(recordTimeStamp);
+			if(RegFifoEnabled()) {
+				QueueOutputRecord(recordTimeStamp);
+			}
+			if(recordsAhead >= GetOutputRateDivider()) {
+				stats.catchUpSkipped++;
+			}
+			else {
+				WriteDataToRegisters(recordTimeStamp);
+			}
 		}
 		// Output calibrated data to SD card
 		else if(GetIMUMode() == MODE_SD_WRITE) {
 			WriteCalibratedDataToSDCard();
 		}
+
+		// Start accumulating the next output period
+		for(i = 0; i < 3; i++) {
+			processedData.dTheta[i] = 0;
+			processedData.dV[i] = 0;
+		}
+
+		// A finished alignment takes effect from the next output period on
+		if(align.phase == ALIGN_STAT_PENDING) {
+			ApplyAlignment();
+		}
 	}
 }
 
+void ProcessDataRecords(uint16_t k, uint16_t n) {
+
+	uint16_t j = 0;
+
+	// Swap in uploaded calibration coefficients at the start of an output frame, so all
+	// records of a frame are calibrated with the same coefficients
+	if((calUpload.phase == CAL_UPLOAD_SWAP) && (outputCount == 0)) {
+		SwapCalibrationBank();
+	}
+
+	// Calibrate and average all of the records in one pass so each sensor's coefficients
+	// are only loaded once for the entire batch
+	// The robust and weighted fusion methods need the data of each sensor
+	// The group calibration never has the data of each sensor, so it always takes the mean
+	bool grouped = IsGroupCalibrationEnabled();
+	uint8_t fusionMode = grouped ? FUSION_MEAN : GetFusionMode();
+	bool robust = (fusionMode == FUSION_MEDIAN) || (fusionMode == FUSION_TRIMMED_MEAN);
+	bool weighted = (fusionMode == FUSION_WEIGHTED);
+	// Gyro bias estimation also needs the data of each sensor while static
+	bool storeSensorData = robust || weighted ||
+			(!grouped && detector.isStatic && IsBiasEstimationEnabled() &&
+			!IsHeadingAlignmentActive());
+
+	uint32_t startCycles = CYCLE_COUNT();
+	uint8_t count = 0;
+	if(grouped) {
+		count = CalibrateGroupSums(k, n);
+	}
+	else {
+		count = CalibrateAndAverageData(k, n, storeSensorData, weighted);
+	}
+	if(robust) {
+		RobustAverageData(n, count, fusionMode);
+	}
+	else if(weighted) {
+		for(j = 0; j < n; j++) {
+			UpdateSensorNoise(j, count);
+		}
+	}
+	calCyclesPerRecord = (CYCLE_COUNT() - startCycles) / n;
+
+#ifdef PROFILE_TWO_STAGE_CAL
+	// Run the same records through the old two-stage path to compare the costs. Both
+	// write the same calibrated values, so the per-sensor data is left as it was.
+	if(!grouped) {
+		startCycles = CYCLE_COUNT();
+		CalibrateData(k, n);
+		AverageData(n);
+		stats.twoStageCalCycles = (CYCLE_COUNT() - startCycles) / n;
+	}
+#endif
+
+	// Refresh the temperature compensation at the reduced rate
+	tempComp.samples += n;
+	if(tempComp.samples >= GetTemperatureCalDivider()) {
+		UpdateDecimatedTemperatureCompensation();
+	}
+
+	// Report the processing cost of the active fusion mode (or of the group calibration),
+	// and keep it with the costs of the other modes
+	RegWriteUInt32(REG_FUSION_CYCLES_1, calCyclesPerRecord);
+	if(grouped) {
+		stats.groupCalCycles = calCyclesPerRecord;
+	}
+	else {
+		stats.fusionCycles[fusionMode] = calCyclesPerRecord;
+	}
+
+	// Remaining processing is done one record at a time, in the order the records
+	// were acquired, so the integration sees every sample in sequence
+	for(j = 0; j < n; j++) {
+		ProcessDataRecord(k, j, count, storeSensorData);
+
+		// Wrap index if we have reached the end of the buffer
+		if(++k >= QUEUE_SIZE) {
+			k = 0;
+		}
+	}
+}
+
+// Removes the 'n' oldest records from the queue
+void DequeueRecords(uint16_t n) {
+	// The DAQ interrupt also modifies the record count, so disable interrupts while
+	// removing the processed records from the queue
+	ROM_IntMasterDisable();
+	queueRecords -= n;
+	ROM_IntMasterEnable();
+
+	// Wrap read index if we have reached the end of the buffer
+	readIdx += n;
+	if(readIdx >= QUEUE_SIZE) {
+		readIdx -= QUEUE_SIZE;
+	}
+}
+
+// Works off a backlog of queued records in full batches, without returning to the main
+// loop in between. Outputs that are superseded within the backlog are not written to the
+// registers, so only the state at the end of the backlog gets published.
+void CatchUpQueue() {
+	uint32_t startCycles = CYCLE_COUNT();
+	uint32_t startTick = tickCount;
+	uint32_t records = 0;
+	uint16_t depth = queueRecords;
+
+	stats.catchUpCount++;
+	stats.catchUpDepth = depth;
+
+	// Records arriving in the meantime are included, but only up to a queue's worth so
+	// the other tasks of the main loop are not held off indefinitely
+	while((depth >= CAL_BATCH_SIZE) && (records < QUEUE_SIZE)) {
+		// Only whole batches are certain to be processed during this catch-up
+		recordsAhead = depth - (depth % CAL_BATCH_SIZE);
+		if(recordsAhead > QUEUE_SIZE - records) {
+			recordsAhead = QUEUE_SIZE - records;
+		}
+
+		ProcessDataRecords(readIdx, CAL_BATCH_SIZE);
+		DequeueRecords(CAL_BATCH_SIZE);
+		records += CAL_BATCH_SIZE;
+		depth = queueRecords;
+	}
+	recordsAhead = 0;
+
+	stats.catchUpRecords = records;
+	stats.catchUpTicks = tickCount - startTick;
+	stats.catchUpCycles = CYCLE_COUNT() - startCycles;
+}
+
 
 // *******************************************************************************
 // IMU SETTINGS
@@ -988,15 +2238,22 @@ int main(void) {
 			ClearSDReadyFlag();
 		}
 
-		// If there are unprocessed records on the queue, get to work!!!
-		if(queueRecords > 0) {
-			ProcessDataRecord(readIdx);
-			queueRecords--;
+		// Handle calibration uploads in the background
+		CalibrationUploadTask();
+		AlignmentTask();
 
-			// Wrap read index if we have reached the end of the buffer
-			if(++readIdx >= QUEUE_SIZE) {
-				readIdx = 0;
-			}
+		// A large backlog (e.g. after the SD card held up the main loop) is worked off
+		// in catch-up mode
+		uint16_t depth = queueRecords;
+		if((depth >= queueConfig.catchUpThreshold) && (depth >= CAL_BATCH_SIZE)) {
+			CatchUpQueue();
+		}
+		// If there are unprocessed records on the queue, get to work!!!
+		else if(depth > 0) {
+			// If a backlog has built up, process a batch of records at once to catch up faster
+			uint16_t n = (depth >= CAL_BATCH_SIZE) ? CAL_BATCH_SIZE : 1;
+			ProcessDataRecords(readIdx, n);
+			DequeueRecords(n);
 		}
 	}
 }
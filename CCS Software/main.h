@@ -12,6 +12,17 @@
 #define IMU_SPI_CLK_SPEED       	(8000000)
 // Number of records to keep in data queue
 #define QUEUE_SIZE     		        (100)
+// Maximum number of queued records calibrated together when the queue has a backlog
+#define CAL_BATCH_SIZE              (4)
+// Queue depth at which the backlog is worked off in catch-up mode (default: 0.1 s of data)
+#define CATCH_UP_THRESHOLD_DEFAULT  (20)
+
+// Sensors are mounted in NUM_GROUPS groups of GROUP_SIZE sensors with the same
+// orientation (see GetIMUData)
+#define NUM_GROUPS                  (4)
+#define GROUP_SIZE                  (NUM_SENSORS / NUM_GROUPS)
+// Number of sets of calibration coefficients: one per sensor, followed by one per group
+#define NUM_CAL_SETS                (NUM_SENSORS + NUM_GROUPS)
 
 // Size of SD card write buffer
 #define SD_BUFFER_SIZE          	(4096)
@@ -19,15 +30,95 @@
 #define RAW_PKT_SIZE_1         		(244)
 #define RAW_PKT_SIZE_2              (212)
 #define CAL_PKT_SIZE                (58)
+#define NAV_PKT_SIZE                (26)
+
+// Number of samples after which the sensor noise statistics used for the fusion
+// weights are faded out (halved)
+#define NOISE_WINDOW                (2000)
+// Smallest mean-square residual used when computing the fusion weights
+#define NOISE_MSE_MIN               (1E-12f)
+
+// Temperature compensation tables. Table entries are spaced (1 << TEMP_LUT_SHIFT) raw
+// temperature counts apart (6.27 deg C), with the first entry at TEMP_LUT_MIN counts
+// (-40.8 deg C). 22 entries cover the -40 to 85 deg C operating range of the sensors.
+// The two tables take 528 bytes per sensor (about 19 KB per coefficient bank).
+#define TEMP_LUT_POINTS             (22)
+#define TEMP_LUT_SHIFT              (11)
+#define TEMP_LUT_MIN                (-21504)
+// The compensation of a sensor is only recomputed once its temperature has moved this
+// many raw counts (0.049 deg C) away from the temperature it was computed for
+#define TEMP_COMP_HYSTERESIS        (16)
+
+// Static interval detector. The averaged data is considered static if the variance
+// (summed over the three axes) of the last STATIC_WINDOW samples is below the thresholds,
+// the specific force is close to gravity and the angular rate is small
+#define STATIC_WINDOW               (100)
+#define STATIC_ACC_VAR              (2.5E-3f)		// (m/s^2)^2
+#define STATIC_GYRO_VAR             (1E-4f)			// (rad/s)^2
+#define STATIC_ACC_TOL              (0.2f)			// m/s^2
+// A few times the residual bias of a calibrated sensor, so a slow steady turn is not
+// taken for a static interval (the Earth rate, 7.3E-5 rad/s, is well below it)
+#define STATIC_GYRO_MAX             (0.005f)		// rad/s
+// Zero-velocity detector (generalized likelihood ratio test over the last ZUPT_WINDOW
+// samples, a power of two). The test statistic is normalized per sample by the noise of
+// the averaged data, the body is stationary while it stays below the threshold.
+#define ZUPT_WINDOW                 (8)
+#define ZUPT_ACC_SIGMA              (0.02f)			// m/s^2
+#define ZUPT_GYRO_SIGMA             (0.005f)		// rad/s
+#define ZUPT_THRESHOLD_DEFAULT      (20.0f)
+// Number of samples averaged by an alignment (default: 5 s of data)
+#define ALIGN_SAMPLES_DEFAULT       (1000)
+// Weight of each static sample in the exponential average of the gyro bias estimates
+// (time constant of 1/(GYRO_BIAS_ALPHA*SAMPLE_RATE) = 5 s of static data)
+#define GYRO_BIAS_ALPHA             (0.001f)
+// Largest correction the estimator applies to the calibrated bias of a sensor, in deg/s.
+// A turn slower than STATIC_GYRO_MAX can still pass the detector, this bounds what it
+// can add to the bias.
+#define GYRO_BIAS_MAX               (0.5f)
+
+// WGS-84 normal gravity (Somigliana) and free-air gradient, used when the local gravity
+// is computed from latitude and height
+#define WGS84_GRAVITY_EQUATOR       (9.7803253359f)		// m/s^2
+#define WGS84_GRAVITY_K             (0.00193185265241f)
+#define WGS84_E2                    (0.00669437999013f)
+#define FREE_AIR_GRADIENT           (3.086E-6f)			// m/s^2 per m
+
+// Calibration upload state machine (see CalibrationUploadTask)
+#define CAL_UPLOAD_IDLE             (0)		// No upload in progress
+#define CAL_UPLOAD_RECEIVING        (1)		// Master is writing the shadow coefficients
+#define CAL_UPLOAD_VERIFY           (2)		// Computing the CRC, one sensor per main loop pass
+#define CAL_UPLOAD_COMPUTE          (3)		// Computing the shadow tables, one sensor per pass
+#define CAL_UPLOAD_SWAP             (4)		// Waiting for the next output frame to swap banks
+
+// Number of averaged samples kept for integration (power of two, at least 5 for Boole's rule)
+#define SAMPLE_WINDOW               (8)
+// Largest number of samples per attitude update (coning compensation)
+#define CONING_MAX_SAMPLES          (4)
+
+// The attitude quaternion is renormalized with a first-order correction every update and
+// exactly every QUAT_RENORM_INTERVAL updates, or when its squared norm is off by more
+// than QUAT_NORM_TOL
+#define QUAT_RENORM_INTERVAL        (100)
+#define QUAT_NORM_TOL               (1E-5f)
+
+// Default gains of the attitude filter (proportional in rad/s, integral in rad/s^2, per
+// unit of gravity direction error)
+#define ATT_FILTER_KP               (0.5f)
+#define ATT_FILTER_KI               (0.005f)
+// The accelerometer only corrects the attitude while the specific force is within this
+// fraction of gravity (i.e. the body is not accelerating much)
+#define ATT_FILTER_ACC_GATE         (0.1f)
 
 // IMU sampling rate (MUST BE INTEGER MULTIPLE OF UPDATE_RATE)
 #define SAMPLE_RATE         (200)
 
 // Digital conversion factors for accelerometer and gyro
-const float K_A = 0.000061035;
-const float K_G = 0.007633587;
-const float DEG_TO_RAD = 0.0174533;
-const float GRAVITY = 9.81;
+static const float K_A = 0.000061035;
+static const float K_G = 0.007633587;
+// Digital conversion factor for temperature (deg C per LSB, relative to 25 deg C)
+static const float K_T = 0.003059976;
+static const float DEG_TO_RAD = 0.0174533;
+static const float GRAVITY = 9.81;
 
 // Definitions used to map array indices to what type of value is at that index.
 // Used in the calibration code
@@ -57,10 +148,23 @@ void GetIMUData(uint32_t timeStamp);
 // Write latest navigation data to the registers
 void WriteDataToRegisters(uint32_t recordTimeStamp);
 
+// Computes the Euler angles, DCM and rotation vector of the last output attitude, if not done yet
+void UpdateDerivedAttitude();
+
+// Applies the navigation settings the master wrote to PAGE_NAV_CFG, called from the I2C
+// interrupt at the stop condition
+void CommitNavigationConfig();
+
 // Writes a raw data record to the SD card
 void WriteRawDataToSDCard(uint16_t k);
 
 // Writes a calibrated data record to the SD card
 void WriteCalibratedDataToSDCard();
 
+// Correction learned by the gyro bias estimator for 'axis' of sensor (or group) 'i', in deg/s
+float GetGyroBiasCorrection(uint8_t axis, uint8_t i);
+
+// Calibrates, averages, integrates and outputs 'n' queued records starting at index 'k'
+void ProcessDataRecords(uint16_t k, uint16_t n);
+
 #endif /* MAIN_H_ */
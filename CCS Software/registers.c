@@ -1,4 +1,5 @@
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include "inc/hw_i2c.h"
 #include "inc/hw_memmap.h"
@@ -23,11 +24,96 @@ volatile bool registerUpdated = false;
 volatile uint8_t state = I2C_STATE_IDLE;
 // Memory address that master is reading/writing to
 volatile uint8_t addr = 0x00;
+// Register address the current read started at
+uint8_t readStart = 0x00;
 // Memory registers accessible via I2C
 char reg[REG_COUNT] = {0x00};
 // Define which registers are read-only and which ones are read-write
 bool regRW[REG_COUNT];
 
+// Memory that can be accessed through the register window
+struct RegisterPage {
+	char *base;
+	uint16_t size;
+	bool writable;
+	void (*refresh)(void);
+	void (*commit)(void);
+};
+struct RegisterPage pages[PAGE_COUNT];
+
+// Buffers of the output registers. The master reads the buffer that was most recent when
+// its read transaction started ('outLatched'), the processing writes to a third one, so a
+// transaction always sees the registers of a single output record. Publishing only
+// changes 'outFront'.
+struct OutputRegisters outBuffer[OUT_BUFFER_COUNT];
+// Buffer last published
+volatile uint8_t outFront = 0;
+// Buffer the current I2C transaction reads from
+volatile uint8_t outLatched = 0;
+// Buffer the output is written to
+uint8_t outBack = 1;
+
+// The output buffer layout has to match the register map byte for byte
+#define OUT_OFFSET(addr)	((addr) - REG_OUT_FIRST)
+STATIC_CHECK(offsetof(struct OutputRegisters, dTheta) == OUT_OFFSET(REG_DELTA_THETA_X_1), out_dtheta);
+STATIC_CHECK(offsetof(struct OutputRegisters, dV) == OUT_OFFSET(REG_DELTA_VEL_X_1), out_dv);
+STATIC_CHECK(offsetof(struct OutputRegisters, Q) == OUT_OFFSET(REG_IQUAT_X_1), out_q);
+STATIC_CHECK(offsetof(struct OutputRegisters, temp) == OUT_OFFSET(REG_TEMP_1), out_temp);
+STATIC_CHECK(offsetof(struct OutputRegisters, accumV) == OUT_OFFSET(REG_ACC_VEL_X_1), out_accumv);
+STATIC_CHECK(offsetof(struct OutputRegisters, tick) == OUT_OFFSET(REG_TICK_1), out_tick);
+STATIC_CHECK(offsetof(struct OutputRegisters, angVel) == OUT_OFFSET(REG_ANG_VEL_X_1), out_angvel);
+STATIC_CHECK(offsetof(struct OutputRegisters, specificForce) == OUT_OFFSET(REG_SP_FORCE_X_1), out_spforce);
+STATIC_CHECK(offsetof(struct OutputRegisters, filterQ) == OUT_OFFSET(REG_OUT_LAST) + 1, out_filterq);
+STATIC_CHECK(offsetof(struct OutputRegisters, seq) == OUT_BUFFER_SIZE - 1, out_seq);
+STATIC_CHECK(sizeof(struct OutputRegisters) == OUT_BUFFER_SIZE, out_size);
+STATIC_CHECK(sizeof(((struct OutputRegisters*)0)->filterQ) ==
+		REG_OUT_FQUAT_LAST - REG_OUT_FQUAT_FIRST + 1, out_filterq_size);
+// Number of outputs published
+uint8_t outSeq = 0;
+
+// Output record FIFO. The counters run freely, the processing only advances 'fifoHead'
+// and the I2C interrupt only 'fifoTail', so neither side needs to lock the other out.
+struct OutputRegisters fifo[OUT_FIFO_DEPTH];
+volatile uint8_t fifoHead = 0;
+volatile uint8_t fifoTail = 0;
+// Next byte of the oldest record to send
+uint8_t fifoByte = 0;
+// Set once the master has selected PAGE_FIFO, records are only queued from then on
+volatile bool fifoEnabled = false;
+// Number of records queued, dropped ones included
+uint8_t fifoSeq = 0;
+
+// I2C interrupt statistics, readable through PAGE_I2C_STATS
+struct I2CStats {
+	// Totals since start-up
+	uint32_t transactions;
+	uint32_t interrupts;
+	uint32_t bytesQueued;
+	// Interrupts, bytes queued for the master and CPU cycles spent in the interrupt
+	// during the last transaction
+	uint32_t lastInterrupts;
+	uint32_t lastBytesQueued;
+	uint32_t lastCycles;
+	// Longest single interrupt, in CPU cycles
+	uint32_t maxCycles;
+	// Totals of the transactions where the master only wrote: transactions, interrupts and
+	// bytes received (register address included). Each byte written takes an interrupt.
+	uint32_t writeTransactions;
+	uint32_t writeInterrupts;
+	uint32_t bytesReceived;
+	// Interrupts and bytes received during the last write transaction
+	uint32_t lastWriteInterrupts;
+	uint32_t lastBytesReceived;
+};
+struct I2CStats i2cStats;
+// Running counts of the current transaction
+uint32_t i2cInterrupts = 0;
+uint32_t i2cBytesQueued = 0;
+uint32_t i2cBytesReceived = 0;
+uint32_t i2cCycles = 0;
+// Page the current transaction wrote to, PAGE_COUNT if none
+uint8_t i2cPageWritten = PAGE_COUNT;
+
 
 // **********************************************************************
 // ************* Initialization Methods *********************************
@@ -42,6 +128,19 @@ void InitializeRegisters(void) {
 	regRW[REG_IMU_EN_3] = 1;
 	regRW[REG_IMU_EN_4] = 1;
 	regRW[REG_IMU_DAQ] = 1;
+	regRW[REG_FUSION] = 1;
+	regRW[REG_PAGE] = 1;
+	regRW[REG_PAGE_BLOCK] = 1;
+	regRW[REG_CAL_CMD] = 1;
+	regRW[REG_CAL_SENSOR] = 1;
+	regRW[REG_CAL_COUNT] = 1;
+	regRW[REG_CAL_CRC_1] = 1;
+	regRW[REG_CAL_CRC_2] = 1;
+	regRW[REG_CAL_CRC_3] = 1;
+	regRW[REG_CAL_CRC_4] = 1;
+	regRW[REG_TEMP_CAL_DIV] = 1;
+	regRW[REG_NAV_CFG] = 1;
+	regRW[REG_ALIGN] = 1;
 
 	// Set the IMU enable registers to their default values
 	reg[REG_IMU_EN_1] = (IMU_ENABLE_DEFAULT & 0x000000FF);
@@ -54,6 +153,193 @@ void InitializeRegisters(void) {
 	reg[REG_IMU_DAQ] |= (SD_OVERWRITE_DEFAULT << 3) & SD_OVERWRITE_MASK;
 	reg[REG_IMU_DAQ] |= (MODE_STREAMING << 1) & IMU_MODE_MASK;
 	reg[REG_IMU_DAQ] |= IMU_DAQ_EN_MASK;
+
+	// Set the fusion register to the default values
+	reg[REG_FUSION] |= FUSION_MODE_DEFAULT & FUSION_MODE_MASK;
+	reg[REG_FUSION] |= (FUSION_TRIM_DEFAULT << 4) & FUSION_TRIM_MASK;
+	reg[REG_FUSION] |= (BIAS_EST_DEFAULT << 2) & BIAS_EST_MASK;
+
+	// Set the temperature compensation rate to the default value
+	reg[REG_TEMP_CAL_DIV] = TEMP_CAL_DIV_DEFAULT;
+
+	RegMapPage(PAGE_I2C_STATS, &i2cStats, sizeof(i2cStats), false);
+
+	// Set the navigation register to the default values
+	reg[REG_NAV_CFG] |= CONING_SAMPLES_DEFAULT & CONING_SAMPLES_MASK;
+	reg[REG_NAV_CFG] |= (INTEGRATION_RULE_DEFAULT << 3) & INTEGRATION_RULE_MASK;
+}
+
+
+void RegMapPage(uint8_t page, void *base, uint16_t size, bool writable) {
+	if(page < PAGE_COUNT) {
+		pages[page].base = (char*)base;
+		pages[page].size = size;
+		pages[page].writable = writable;
+	}
+}
+
+void RegSetPageRefresh(uint8_t page, void (*refresh)(void)) {
+	if(page < PAGE_COUNT) {
+		pages[page].refresh = refresh;
+	}
+}
+
+void RegSetPageCommit(uint8_t page, void (*commit)(void)) {
+	if(page < PAGE_COUNT) {
+		pages[page].commit = commit;
+	}
+}
+
+// Returns the position of output register 'addr' in the output buffers, or -1 if 'addr'
+// is not an output register
+static int16_t RegOutputOffset(uint8_t addr) {
+	if((addr >= REG_OUT_FIRST) && (addr <= REG_OUT_LAST)) {
+		return addr - REG_OUT_FIRST;
+	}
+	if((addr >= REG_OUT_FQUAT_FIRST) && (addr <= REG_OUT_FQUAT_LAST)) {
+		return (REG_OUT_LAST - REG_OUT_FIRST + 1) + (addr - REG_OUT_FQUAT_FIRST);
+	}
+	if(addr == REG_OUT_SEQ) {
+		return OUT_BUFFER_SIZE - 1;
+	}
+	return -1;
+}
+
+// Returns a pointer to the memory the processing writes register 'addr' to
+static char* RegWriteLocate(uint8_t addr) {
+	int16_t offset = RegOutputOffset(addr);
+	return (offset >= 0) ? (char*)&outBuffer[outBack] + offset : &reg[addr];
+}
+
+// Returns a pointer to the memory behind register 'addr', or 0 if there is none. Registers
+// in the window map to the selected page, output registers to the latched output buffer.
+static char* RegLocate(uint8_t addr) {
+	int16_t offset = RegOutputOffset(addr);
+	if(offset >= 0) {
+		return (char*)&outBuffer[outLatched] + offset;
+	}
+	// Register is in the window and a page is selected
+	if((addr >= REG_SD_DATA) && (addr <= REG_SD_DATA_LAST) && (reg[REG_PAGE] != PAGE_SD_DATA)) {
+		uint8_t page = reg[REG_PAGE];
+		uint32_t offset = (uint32_t)reg[REG_PAGE_BLOCK]*SD_DATA_REG_COUNT + (addr - REG_SD_DATA);
+
+		if((page >= PAGE_COUNT) || (offset >= pages[page].size)) {
+			return 0;
+		}
+		return &pages[page].base[offset];
+	}
+	return &reg[addr];
+}
+
+// Returns true if register 'addr' reads from the output record FIFO
+static bool RegIsFifo(uint8_t addr) {
+	return (addr >= REG_SD_DATA) && (addr <= REG_SD_DATA_LAST) && (reg[REG_PAGE] == PAGE_FIFO);
+}
+
+// Returns the next byte of the oldest record in the FIFO, removing the record once all of
+// it has been read
+static uint8_t RegPopFifo(void) {
+	if(fifoTail == fifoHead) {
+		return 0x00;
+	}
+	uint8_t val = ((char*)&fifo[fifoTail & (OUT_FIFO_DEPTH - 1)])[fifoByte];
+	if(++fifoByte >= OUT_RECORD_SIZE) {
+		fifoByte = 0;
+		fifoTail++;
+	}
+	return val;
+}
+
+// Lets the selected page update itself if it is computed on demand. Called once when a
+// read transaction begins, so the whole read sees the same values.
+static void RegRefreshPage(void) {
+	uint8_t page = reg[REG_PAGE];
+	if((page < PAGE_COUNT) && pages[page].refresh) {
+		pages[page].refresh();
+	}
+}
+
+// Moves the transaction to the read state. The transmit FIFO request interrupt is only
+// needed while the master reads, it is turned off again at the stop condition.
+static void RegBeginRead(void) {
+	if(state != I2C_STATE_READ) {
+		state = I2C_STATE_READ;
+		readStart = addr;
+		RegRefreshPage();
+		I2CSlaveIntEnableEx(CDH_I2C_BASE, I2C_SLAVE_INT_TX_FIFO_REQ);
+	}
+}
+
+// Returns the value the I2C master reads at register 'addr'
+static uint8_t RegRead(uint8_t addr) {
+	if(RegIsFifo(addr)) {
+		return RegPopFifo();
+	}
+	if(addr == REG_FIFO_COUNT) {
+		return (uint8_t)(fifoHead - fifoTail);
+	}
+	char *p = RegLocate(addr);
+	return p ? *p : 0x00;
+}
+
+// Moves the register address of the transaction to the next register. It stops at the last
+// one (REG_FIFO_COUNT) instead of wrapping around to REG_IMU_EN_1.
+static void RegNextAddr(void) {
+	if(addr < REG_COUNT - 1) {
+		addr++;
+	}
+}
+
+// Returns true if reading register 'addr' changes something, so it may only be read when
+// the master is known to be waiting for it
+static bool RegHasReadSideEffect(uint8_t addr) {
+	return RegIsFifo(addr) || ((addr == REG_SD_DATA_LAST) && (reg[REG_PAGE] == PAGE_SD_DATA));
+}
+
+// Queues the registers starting at 'addr' in the transmit FIFO. 'requested' is true if
+// the master is waiting for a byte (the FIFO has run empty).
+static void RegFillTxFifo(bool requested) {
+	uint8_t n = 0;
+
+	while(n < I2C_TX_LOOKAHEAD) {
+		if(RegHasReadSideEffect(addr)) {
+			// Only the byte the master is waiting for, like without the FIFO
+			if(!requested || (n > 0)) {
+				break;
+			}
+			I2CFIFODataPutNonBlocking(CDH_I2C_BASE, RegRead(addr));
+
+			// If master reads last SD data register, need to update the data registers.
+			// SD_READY flag is raised, notifying main loop to read more data from the SD
+			// card and copy it to the data registers
+			if((addr == REG_SD_DATA_LAST) && (reg[REG_PAGE] == PAGE_SD_DATA)) {
+				reg[REG_SD_STAT] |= SD_READY_MASK;
+			}
+			// The FIFO is read through a fixed address
+			if(!RegIsFifo(addr)) {
+				RegNextAddr();
+			}
+			n++;
+			break;
+		}
+
+		// Reading ahead is harmless here, bytes the master does not take are flushed at
+		// the stop condition
+		if(!I2CFIFODataPutNonBlocking(CDH_I2C_BASE, RegRead(addr))) {
+			break;
+		}
+		RegNextAddr();
+		n++;
+	}
+	i2cBytesQueued += n;
+}
+
+// Returns true if the I2C master may write to register 'addr'
+static bool RegIsWritable(uint8_t addr) {
+	if((addr >= REG_SD_DATA) && (addr <= REG_SD_DATA_LAST) && (reg[REG_PAGE] != PAGE_SD_DATA)) {
+		return (reg[REG_PAGE] < PAGE_COUNT) && pages[(uint8_t)reg[REG_PAGE]].writable;
+	}
+	return regRW[addr];
 }
 
 
@@ -72,12 +358,7 @@ uint8_t GetIMUMode(void) {
 
 uint8_t GetRegVal(uint8_t addr) {
 	// If address is out of range, just return 0
-	if(addr >= REG_COUNT) {
-		return 0;
-	}
-	else {
-		return reg[addr];
-	}
+	return RegRead(addr);
 }
 
 bool GetSDFileOverwrite(void) {
@@ -96,6 +377,84 @@ uint8_t GetOutputRateDivider(void) {
 	return outputRateDiv;
 }
 
+uint8_t GetTemperatureCalDivider(void) {
+	uint8_t div = reg[REG_TEMP_CAL_DIV];
+
+	// Zero would never update, treat it as updating every sample
+	return (div > 0) ? div : 1;
+}
+
+uint8_t GetConingSamples(void) {
+	uint8_t n = reg[REG_NAV_CFG] & CONING_SAMPLES_MASK;
+
+	// Only 2, 3 and 4-sample algorithms are implemented
+	if((n < 2) || (n > 4)) {
+		n = CONING_SAMPLES_DEFAULT;
+	}
+
+	return n;
+}
+
+uint8_t GetIntegrationRule(void) {
+	uint8_t rule = (reg[REG_NAV_CFG] & INTEGRATION_RULE_MASK) >> 3;
+
+	if(rule > INTEGRATION_BOOLE) {
+		rule = INTEGRATION_RULE_DEFAULT;
+	}
+
+	return rule;
+}
+
+bool IsAttitudeFilterEnabled(void) {
+	return (bool)(reg[REG_NAV_CFG] & ATT_FILTER_EN_MASK);
+}
+
+bool IsEKFEnabled(void) {
+	return (bool)(reg[REG_NAV_CFG] & EKF_EN_MASK);
+}
+
+bool IsAttitudeSubscribed(void) {
+	return (bool)(reg[REG_NAV_CFG] & ATT_SUBSCRIBE_MASK);
+}
+
+uint8_t GetCalCommand(void) {
+	return reg[REG_CAL_CMD];
+}
+
+uint8_t GetAlignCommand(void) {
+	return reg[REG_ALIGN] & ALIGN_CMD_MASK;
+}
+
+uint8_t GetCalSensor(void) {
+	return reg[REG_CAL_SENSOR];
+}
+
+uint8_t GetCalCount(void) {
+	return reg[REG_CAL_COUNT];
+}
+
+uint32_t GetCalCRC(void) {
+	uint32_t crc;
+	memcpy(&crc, &reg[REG_CAL_CRC_1], sizeof(crc));
+	return crc;
+}
+
+uint8_t GetFusionMode(void) {
+	return (reg[REG_FUSION] & FUSION_MODE_MASK);
+}
+
+uint8_t GetFusionTrim(void) {
+	return (reg[REG_FUSION] & FUSION_TRIM_MASK) >> 4;
+}
+
+bool IsBiasEstimationEnabled(void) {
+	return (bool)(reg[REG_FUSION] & BIAS_EST_MASK);
+}
+
+bool IsGroupCalibrationEnabled(void) {
+	return (bool)(reg[REG_FUSION] & GROUP_CAL_MASK);
+}
+
 bool IsDAQEnabled(void) {
 	return (bool)(reg[REG_IMU_DAQ] & IMU_DAQ_EN_MASK);
 }
@@ -114,6 +473,14 @@ bool IsSDDataRequested(void) {
 // **********************************************************************
 
 
+void ClearCalCommand(void) {
+	reg[REG_CAL_CMD] = CAL_CMD_NONE;
+}
+
+void ClearAlignCommand(void) {
+	reg[REG_ALIGN] &= ~ALIGN_CMD_MASK;
+}
+
 void ClearSDEOFFlag(void) {
 	reg[REG_SD_STAT] &= ~SD_EOF_MASK;
 }
@@ -130,11 +497,28 @@ void RaiseSDEOFFlag(void) {
 	reg[REG_SD_STAT] |= SD_EOF_MASK;
 }
 
+void SetCalStatus(uint8_t status) {
+	reg[REG_CAL_STAT] = status;
+}
+
+void SetAlignStatus(uint8_t status) {
+	reg[REG_ALIGN] = (reg[REG_ALIGN] & ~ALIGN_STAT_MASK) | ((status << 4) & ALIGN_STAT_MASK);
+}
+
+void SetStatusFlag(uint8_t mask, bool value) {
+	if(value) {
+		reg[REG_IMU_STAT] |= mask;
+	}
+	else {
+		reg[REG_IMU_STAT] &= ~mask;
+	}
+}
+
 void RegWriteFloat32(uint8_t addr, float val) {
 	// Make sure we don't write to memory outside of registers
 	if(addr <= REG_COUNT - sizeof(val)) {
 		// Copy value to memory location at address
-		memcpy(&reg[addr], &val, sizeof(val));
+		memcpy(RegWriteLocate(addr), &val, sizeof(val));
 	}
 }
 
@@ -142,12 +526,50 @@ void RegWriteUInt32(uint8_t addr, uint32_t val) {
 	// Make sure we don't write to memory outside of registers
 	if(addr <= REG_COUNT - sizeof(val)) {
 		// Copy value to memory location at address
-		memcpy(&reg[addr], &val, sizeof(val));
+		memcpy(RegWriteLocate(addr), &val, sizeof(val));
 	}
 }
 
 void RegWriteUInt8(uint8_t addr, uint8_t val) {
-	reg[addr] = val;
+	*RegWriteLocate(addr) = val;
+}
+
+struct OutputRegisters* RegOutputBuffer(void) {
+	return &outBuffer[outBack];
+}
+
+void RegPublishOutput(void) {
+	uint8_t i = 0;
+
+	outBuffer[outBack].seq = ++outSeq;
+	outFront = outBack;
+
+	// Continue in the buffer no transaction can be reading. If the interrupt latches a
+	// buffer after 'outLatched' is read here, it is the new front buffer.
+	uint8_t latched = outLatched;
+	for(i = 0; i < OUT_BUFFER_COUNT; i++) {
+		if((i != outFront) && (i != latched)) {
+			outBack = i;
+			break;
+		}
+	}
+}
+
+bool RegFifoEnabled(void) {
+	return fifoEnabled;
+}
+
+bool RegPushRecord(const struct OutputRegisters *record) {
+	fifoSeq++;
+	if((uint8_t)(fifoHead - fifoTail) >= OUT_FIFO_DEPTH) {
+		return false;
+	}
+	struct OutputRegisters *slot = &fifo[fifoHead & (OUT_FIFO_DEPTH - 1)];
+	*slot = *record;
+	slot->seq = fifoSeq;
+	// The record has to be complete before the interrupt can see it
+	fifoHead++;
+	return true;
 }
 
 
@@ -158,6 +580,8 @@ void RegWriteUInt8(uint8_t addr, uint8_t val) {
 
 void I2C0SlaveIntHandler(void) {
 
+	uint32_t startCycles = CYCLE_COUNT();
+
 	// Read the interrupt status register (what kind of interrupt is this?)
 	uint32_t slaveIntReg = HWREG(CDH_I2C_BASE + I2C_O_SMIS);
 	// Status indicates if data is read or write
@@ -167,23 +591,26 @@ void I2C0SlaveIntHandler(void) {
 	if(slaveIntReg & I2C_SMIS_STARTMIS) {
 		// Clear start bit in interrupt status register
 		HWREG(CDH_I2C_BASE + I2C_O_SICR) |= I2C_SICR_STARTIC;
+		// The transaction reads the latest output from start to end
+		outLatched = outFront;
 
 		switch(state) {
 			// If currently idle, start new transaction
 			case I2C_STATE_IDLE:
 				state = I2C_STATE_START;
 				break;
+			// Repeated start after the address was written, a read begins
 			default:
-				state = I2C_STATE_READ;
+				RegBeginRead();
 				break;
 		}
 	}
-	// Master sent stop condition
-	if(slaveIntReg & I2C_SMIS_STOPMIS) {
-		// Clear stop bit in interrupt status register
-		HWREG(CDH_I2C_BASE + I2C_O_SICR) |= I2C_SICR_STOPIC;
-		// No matter what state we were in previously, go to idle state
-		state = I2C_STATE_IDLE;
+	// Transmit FIFO is running low while the master is reading, top it up
+	if(slaveIntReg & I2C_SMIS_TXMIS) {
+		HWREG(CDH_I2C_BASE + I2C_O_SICR) |= I2C_SICR_TXIC;
+		if(state == I2C_STATE_READ) {
+			RegFillTxFifo(false);
+		}
 	}
 	// Master sent a byte of data. Could be address or data
 	if(slaveIntReg & I2C_SMIS_DATAMIS) {
@@ -193,56 +620,56 @@ void I2C0SlaveIntHandler(void) {
 		// Master is requesting data
 		if(status & I2C_SLAVE_ACT_TREQ) {
 			switch(state) {
-				// Address received
+				// Address received, master is writing data to IMU or reading data from IMU.
+				// Queue the data at the address and following ones, incrementing the address.
+				// A read without a register address starts where the last one did (see the
+				// stop condition).
+				case I2C_STATE_START:
 				case I2C_STATE_ADDR:
-					// Send data at address and increment address
-					I2CSlaveDataPut(CDH_I2C_BASE, reg[addr++]);
-					state = I2C_STATE_READ;
-					break;
-				// Master is writing data to IMU
 				case I2C_STATE_WRITE:
-					I2CSlaveDataPut(CDH_I2C_BASE, reg[addr++]);
-					break;
-				// Master is reading data from IMU
 				case I2C_STATE_READ:
-					// Send data at address and increment address
-					I2CSlaveDataPut(CDH_I2C_BASE, reg[addr]);
-
-					// If master reads last SD data register, need to update the data registers.
-					// SD_READY flag is raised, notifying main loop to read more data from the SD
-					// card and copy it to the data registers
-					if(addr == REG_SD_DATA_LAST) {
-						reg[REG_SD_STAT] |= SD_READY_MASK;
-					}
-					addr++;
-
+					RegBeginRead();
+					RegFillTxFifo(true);
 					break;
 				// This is an invalid state but we must handle it anyway
 				default:
 					// Write garbage
-					I2CSlaveDataPut(CDH_I2C_BASE, 0x00);
+					I2CFIFODataPutNonBlocking(CDH_I2C_BASE, 0x00);
 					break;
 			}
 		}
 		// Master is transmitting data
 		else {
+			i2cBytesReceived++;
 			switch(state) {
 				// Start condition sent
 				case I2C_STATE_START:
 					// Store address
 					addr = I2CSlaveDataGet(CDH_I2C_BASE);
 					state = I2C_STATE_ADDR;
+					// A record the master stopped reading part way is sent again from the start
+					fifoByte = 0;
 					break;
 				// Master is writing data to IMU data registers
 				case I2C_STATE_ADDR:
 				case I2C_STATE_WRITE:
 					// Only update register if it is read/write
-					if(regRW[addr]) {
+					if(RegIsWritable(addr) && RegLocate(addr)) {
 						// If settings register is updated, raise flag
 						if(addr == REG_IMU_DAQ) {
 							registerUpdated = true;
 						}
-						reg[addr++] = I2CSlaveDataGet(CDH_I2C_BASE);
+						*RegLocate(addr) = I2CSlaveDataGet(CDH_I2C_BASE);
+						// The first selection of the FIFO page starts the FIFO empty
+						if((addr == REG_PAGE) && (reg[REG_PAGE] == PAGE_FIFO) && !fifoEnabled) {
+							fifoTail = fifoHead;
+							fifoByte = 0;
+							fifoEnabled = true;
+						}
+						if((addr >= REG_SD_DATA) && (addr <= REG_SD_DATA_LAST)) {
+							i2cPageWritten = reg[REG_PAGE];
+						}
+						RegNextAddr();
 
 						state = I2C_STATE_WRITE;
 					}
@@ -258,4 +685,53 @@ void I2C0SlaveIntHandler(void) {
 			}
 		}
 	}
+
+	uint32_t cycles = CYCLE_COUNT() - startCycles;
+	i2cInterrupts++;
+	i2cCycles += cycles;
+	if(cycles > i2cStats.maxCycles) {
+		i2cStats.maxCycles = cycles;
+	}
+
+	// Master sent stop condition
+	if(slaveIntReg & I2C_SMIS_STOPMIS) {
+		// Clear stop bit in interrupt status register
+		HWREG(CDH_I2C_BASE + I2C_O_SICR) |= I2C_SICR_STOPIC;
+		// The master only wrote if the transaction never got to the read state
+		if(state != I2C_STATE_READ) {
+			i2cStats.writeTransactions++;
+			i2cStats.writeInterrupts += i2cInterrupts;
+			i2cStats.bytesReceived += i2cBytesReceived;
+			i2cStats.lastWriteInterrupts = i2cInterrupts;
+			i2cStats.lastBytesReceived = i2cBytesReceived;
+		}
+		// The master is done writing the page, let it apply the new contents at once
+		if((i2cPageWritten < PAGE_COUNT) && pages[i2cPageWritten].commit) {
+			pages[i2cPageWritten].commit();
+		}
+		i2cPageWritten = PAGE_COUNT;
+		// The bytes read ahead are flushed below and there is no telling how many of them
+		// the master took, so a read without a register address repeats the last one. The
+		// output record FIFO is never read ahead and continues where the master stopped.
+		if((state == I2C_STATE_READ) && !RegIsFifo(addr)) {
+			addr = readStart;
+		}
+		// No matter what state we were in previously, go to idle state
+		state = I2C_STATE_IDLE;
+		// Stop the transmit FIFO requests until the next read and drop the bytes that were
+		// read ahead but not taken by the master
+		I2CSlaveIntDisableEx(CDH_I2C_BASE, I2C_SLAVE_INT_TX_FIFO_REQ);
+		I2CTxFIFOFlush(CDH_I2C_BASE);
+
+		i2cStats.transactions++;
+		i2cStats.interrupts += i2cInterrupts;
+		i2cStats.bytesQueued += i2cBytesQueued;
+		i2cStats.lastInterrupts = i2cInterrupts;
+		i2cStats.lastBytesQueued = i2cBytesQueued;
+		i2cStats.lastCycles = i2cCycles;
+		i2cInterrupts = 0;
+		i2cBytesQueued = 0;
+		i2cBytesReceived = 0;
+		i2cCycles = 0;
+	}
 }
@@ -20,7 +20,7 @@
 #define SLAVE_ADDRESS           	(0x30)
 
 // Number of registers
-#define REG_COUNT   	            (220)
+#define REG_COUNT   	            (256)
 // Number of SD data registers
 #define SD_DATA_REG_COUNT           (128)
 // Declare registers as external so they can be accessed by the main function
@@ -36,12 +36,88 @@ extern char reg[REG_COUNT];
 #define SD_OVERWRITE_DEFAULT        (0x00000000)	// No overwrite
 #define OUTPUT_RATE_DIV_DEFAULT     (0x0000000A)	// 10X divider
 #define DAQ_ENABLE_DEFAULT 	        (0x00000001)	// Enabled
+#define FUSION_MODE_DEFAULT         (0x00000000)	// Mean of all sensors
+#define FUSION_TRIM_DEFAULT         (0x00000004)	// Trim 4/32 of the sensors from each end
+#define BIAS_EST_DEFAULT            (0x00000001)	// Gyro bias estimation enabled
+#define CONING_SAMPLES_DEFAULT      (0x00000002)	// 2-sample coning compensation
+#define INTEGRATION_RULE_DEFAULT    (0x00000001)	// Simpson's rule
+#define TEMP_CAL_DIV_DEFAULT        (0x000000C8)	// Temperature compensation updated every 200 samples (1 Hz)
+// REG_TEMP_CAL_DIV is a single byte, so the slowest update rate is every 255 samples (0.78 Hz)
+
+// Methods used to fuse the data of all sensors into a single value for each axis
+#define FUSION_MEAN                 (0x00)		// Arithmetic mean
+#define FUSION_MEDIAN               (0x01)		// Median
+#define FUSION_TRIMMED_MEAN         (0x02)		// Mean after discarding the smallest and largest values
+#define FUSION_WEIGHTED             (0x03)		// Inverse-variance weighted mean
+#define FUSION_MODE_COUNT           (4)
+
+// Rules used to integrate the averaged samples over each sample interval
+#define INTEGRATION_TRAPEZOID       (0x00)		// Linear fit through the last 2 samples
+#define INTEGRATION_SIMPSON         (0x01)		// Parabolic fit through the last 3 samples
+#define INTEGRATION_BOOLE           (0x02)		// Quartic fit through the last 5 samples
+
+// Register pages. When a page other than PAGE_SD_DATA is selected, the SD data registers
+// become a window onto the memory of that page. The window shows SD_DATA_REG_COUNT bytes
+// of the page at a time, starting at byte (REG_PAGE_BLOCK * SD_DATA_REG_COUNT).
+#define PAGE_SD_DATA                (0x00)		// SD card data (default)
+#define PAGE_FUSION_WEIGHTS         (0x01)		// Fusion weights, float[6][32] (AX..GZ, sensor)
+#define PAGE_CAL_UPLOAD             (0x02)		// Calibration coefficients being uploaded (writable)
+#define PAGE_STATS                  (0x03)		// Processing statistics
+#define PAGE_GYRO_BIAS              (0x04)		// Gyro bias estimates in deg/s (array float[3], sensors float[3][32]), each sensor limited to GYRO_BIAS_MAX
+#define PAGE_NAV                    (0x05)		// Navigation output (velocity float[3], position float[3], gravity)
+#define PAGE_NAV_CFG                (0x06)		// Navigation settings (gravity, latitude, height), writable
+#define PAGE_FILTER_CFG             (0x07)		// Attitude filter gains (Kp, Ki), writable
+#define PAGE_EKF                    (0x08)		// Kalman filter output (struct EKFOutput)
+#define PAGE_EKF_CFG                (0x09)		// Kalman filter noise settings (struct EKFConfig), writable
+#define PAGE_ATTITUDE               (0x0A)		// Euler angles, DCM and rotation vector, computed when read
+#define PAGE_QUEUE_CFG              (0x0B)		// Data queue settings (catch-up threshold), writable
+#define PAGE_FIFO                   (0x0C)		// Output record FIFO (see OUT_RECORD_SIZE)
+#define PAGE_I2C_STATS              (0x0D)		// I2C interrupt statistics (struct I2CStats)
+#define PAGE_COUNT                  (14)
+
+// Calibration upload commands (written to REG_CAL_CMD)
+#define CAL_CMD_NONE                (0x00)
+#define CAL_CMD_BEGIN               (0x01)		// Map the shadow coefficients of the selected sensors
+#define CAL_CMD_COMMIT              (0x02)		// Validate the uploaded coefficients and swap them in
+#define CAL_CMD_ABORT               (0x03)		// Discard the uploaded coefficients
+
+// Calibration upload status (read from REG_CAL_STAT)
+#define CAL_STAT_IDLE               (0x00)		// No upload in progress
+#define CAL_STAT_RECEIVING          (0x01)		// Waiting for the master to write the coefficients
+#define CAL_STAT_BUSY               (0x02)		// Validating and processing the uploaded coefficients
+#define CAL_STAT_DONE               (0x03)		// New coefficients are in use
+#define CAL_STAT_CRC_ERROR          (0x04)		// CRC did not match, coefficients were discarded
+#define CAL_STAT_INVALID            (0x05)		// Invalid sensor range or command
+
+// Alignment commands (written to the low nibble of REG_ALIGN). While static, the gyro bias
+// estimator (BIAS_EST_MASK) also learns the Earth rate as bias. A heading alignment holds
+// the estimator while it averages and adds the learned bias back before taking the
+// heading, so it sees the Earth rate again. The integrated attitude still loses the Earth
+// rate once estimation resumes.
+#define ALIGN_CMD_NONE              (0x00)
+#define ALIGN_CMD_LEVEL             (0x01)		// Level: roll and pitch from the specific force
+#define ALIGN_CMD_HEADING           (0x02)		// Level and coarse heading from the Earth rate
+#define ALIGN_CMD_ABORT             (0x03)		// Stop averaging, keep the current attitude
+
+// Alignment status (read from the high nibble of REG_ALIGN)
+#define ALIGN_STAT_IDLE             (0x00)		// No alignment in progress
+#define ALIGN_STAT_AVERAGING        (0x01)		// Averaging the data
+#define ALIGN_STAT_PENDING          (0x02)		// Waiting for the end of the output frame
+#define ALIGN_STAT_DONE             (0x03)		// Attitude has been seeded
+#define ALIGN_STAT_INVALID          (0x04)		// Invalid command or no usable specific force
 
 // Peripheral pin assignments
 #define CDH_I2C_BASE	        	I2C0_BASE
 #define CDH_I2C_SDA	           		I2C0_SDA
 #define CDH_I2C_SCL     			I2C0_SCL
 
+// Reads are served from the transmit FIFO of the I2C module. Up to I2C_TX_LOOKAHEAD bytes
+// are read ahead and queued per interrupt (1 queues one byte per interrupt, as without the
+// FIFO). Registers with side effects when read are never read ahead. The bytes the master
+// does not take are dropped at the stop condition, so a read without a register address
+// starts at the register the previous read started at.
+#define I2C_TX_LOOKAHEAD            (8)
+
 // I2C interrupt state machine
 #define I2C_STATE_IDLE              (0x00)      // I2C transcation is completed, nothing to do
 #define I2C_STATE_START         	(0x01)		// Start condition detected
@@ -157,6 +233,91 @@ extern char reg[REG_COUNT];
 #define REG_SD_DATA                 (0x5C)
 #define REG_SD_DATA_LAST 	        (0xDB)
 
+#define REG_FUSION                  (0xDC)
+
+// CPU cycles taken to calibrate and fuse a record in the active mode. The cost of every
+// mode that has been active is kept in the processing statistics (PAGE_STATS).
+#define REG_FUSION_CYCLES_1         (0xDD)
+#define REG_FUSION_CYCLES_2         (0xDE)
+#define REG_FUSION_CYCLES_3         (0xDF)
+#define REG_FUSION_CYCLES_4         (0xE0)
+
+#define REG_PAGE                    (0xE1)
+#define REG_PAGE_BLOCK              (0xE2)
+
+#define REG_CAL_CMD                 (0xE3)
+#define REG_CAL_STAT                (0xE4)
+#define REG_CAL_SENSOR              (0xE5)
+#define REG_CAL_COUNT               (0xE6)
+#define REG_CAL_CRC_1               (0xE7)
+#define REG_CAL_CRC_2               (0xE8)
+#define REG_CAL_CRC_3               (0xE9)
+#define REG_CAL_CRC_4               (0xEA)
+
+#define REG_TEMP_CAL_DIV            (0xEB)
+#define REG_NAV_CFG                 (0xEC)
+
+#define REG_FQUAT_X_1	            (0xED)
+#define REG_FQUAT_X_2	            (0xEE)
+#define REG_FQUAT_X_3	            (0xEF)
+#define REG_FQUAT_X_4	            (0xF0)
+#define REG_FQUAT_Y_1	            (0xF1)
+#define REG_FQUAT_Y_2	            (0xF2)
+#define REG_FQUAT_Y_3	            (0xF3)
+#define REG_FQUAT_Y_4	            (0xF4)
+#define REG_FQUAT_Z_1	            (0xF5)
+#define REG_FQUAT_Z_2	            (0xF6)
+#define REG_FQUAT_Z_3	            (0xF7)
+#define REG_FQUAT_Z_4	            (0xF8)
+#define REG_FQUAT_W_1	            (0xF9)
+#define REG_FQUAT_W_2	            (0xFA)
+#define REG_FQUAT_W_3	            (0xFB)
+#define REG_FQUAT_W_4	            (0xFC)
+
+#define REG_ALIGN                   (0xFD)
+#define REG_OUT_SEQ                 (0xFE)
+#define REG_FIFO_COUNT              (0xFF)
+
+// Output registers. Writes to them go to a back buffer and only become visible to the
+// master when the buffer is published, all at once (see RegPublishOutput).
+#define REG_OUT_FIRST               (REG_DELTA_THETA_X_1)
+#define REG_OUT_LAST                (REG_SP_FORCE_Z_4)
+#define REG_OUT_FQUAT_FIRST         (REG_FQUAT_X_1)
+#define REG_OUT_FQUAT_LAST          (REG_FQUAT_W_4)
+#define OUT_BUFFER_SIZE             ((REG_OUT_LAST - REG_OUT_FIRST + 1) + \
+                                     (REG_OUT_FQUAT_LAST - REG_OUT_FQUAT_FIRST + 1) + 1)
+#define OUT_BUFFER_COUNT            (3)
+
+// Layout of an output buffer. Each member sits at the offset of its registers (checked at
+// compile time in registers.c), so the output can be filled in directly instead of register
+// by register. Quaternions are (X, Y, Z, W).
+struct OutputRegisters {
+	float dTheta[3];			// REG_DELTA_THETA_X_1
+	float dV[3];				// REG_DELTA_VEL_X_1
+	float Q[4];					// REG_IQUAT_X_1
+	float temp;					// REG_TEMP_1
+	float accumV[3];			// REG_ACC_VEL_X_1
+	uint32_t tick;				// REG_TICK_1
+	float angVel[3];			// REG_ANG_VEL_X_1
+	float specificForce[3];		// REG_SP_FORCE_X_1
+	float filterQ[4];			// REG_FQUAT_X_1
+	uint8_t seq;				// REG_OUT_SEQ
+} __attribute__((packed));
+
+// Output record FIFO. While PAGE_FIFO is selected, every byte read from the window pops
+// the next byte of the oldest record, without advancing the register address, so one burst
+// read of n * OUT_RECORD_SIZE bytes returns n records. Each record is an output buffer
+// (struct OutputRegisters), with REG_OUT_SEQ counting the records queued, dropped ones
+// included. A record is only removed once all of it has been read. The window is never
+// read ahead, so reads of it without a new register address continue at the record byte
+// where the last one stopped (for masters with short read buffers), sending a register
+// address restarts the record being read. REG_FIFO_COUNT holds the number of complete
+// records waiting. New records are dropped (and counted) while the FIFO is full. Records
+// are only queued once the master has selected PAGE_FIFO for the first time, which also
+// empties the FIFO, so a master that never uses it does not see overflows.
+#define OUT_RECORD_SIZE             (OUT_BUFFER_SIZE)
+#define OUT_FIFO_DEPTH              (32)		// Power of two
+
 // **********************************************************************
 // ************* Bit Masks **********************************************
 // **********************************************************************
@@ -168,6 +329,19 @@ extern char reg[REG_COUNT];
 #define IMU_DAQ_EN_MASK				(0x01)
 #define SD_READY_MASK      			(0x01)
 #define SD_EOF_MASK        			(0x02)
+#define FUSION_MODE_MASK            (0x03)
+#define FUSION_TRIM_MASK            (0xF0)
+#define BIAS_EST_MASK               (0x04)
+#define GROUP_CAL_MASK              (0x08)
+#define STAT_STATIC_MASK            (0x01)
+#define STAT_ZUPT_MASK              (0x02)
+#define ALIGN_CMD_MASK              (0x0F)
+#define ALIGN_STAT_MASK             (0xF0)
+#define CONING_SAMPLES_MASK         (0x07)
+#define INTEGRATION_RULE_MASK       (0x18)
+#define ATT_FILTER_EN_MASK          (0x20)
+#define EKF_EN_MASK                 (0x40)
+#define ATT_SUBSCRIBE_MASK          (0x80)
 
 
 // **********************************************************************
@@ -178,6 +352,19 @@ extern char reg[REG_COUNT];
 // Configures the registers to their default values
 void InitializeRegisters(void);
 
+// Makes the 'size' bytes at 'base' readable through the register window when 'page' is
+// selected. If 'writable' is true, the master may also write to that memory.
+void RegMapPage(uint8_t page, void *base, uint16_t size, bool writable);
+
+// Calls 'refresh' from the I2C interrupt when a read transaction begins while 'page' is
+// selected, so the page can be brought up to date only when the master actually reads it
+void RegSetPageRefresh(uint8_t page, void (*refresh)(void));
+
+// Calls 'commit' from the I2C interrupt at the stop condition of a transaction that wrote
+// to 'page'. Settings the master writes one byte at a time can be kept in a copy mapped
+// to the page and only applied once the master is done with them.
+void RegSetPageCommit(uint8_t page, void (*commit)(void));
+
 
 // **********************************************************************
 // ************* Accessor Methods ***************************************
@@ -190,15 +377,64 @@ uint8_t GetI2CState(void);
 // Gets the operating mode
 uint8_t GetIMUMode(void);
 
-// Returns the value of the register at 'addr'
+// Returns the value of the register at 'addr' (as seen by the I2C master)
 uint8_t GetRegVal(uint8_t addr);
 
 // Returns the output rate divider
 uint8_t GetOutputRateDivider(void);
 
+// Returns the number of samples the temperature is averaged over between updates of the
+// temperature compensation (at least 1)
+uint8_t GetTemperatureCalDivider(void);
+
+// Returns the number of samples (2, 3 or 4) per attitude update, which selects the
+// coning compensation algorithm
+uint8_t GetConingSamples(void);
+
+// Returns the rule used to integrate the samples (INTEGRATION_*)
+uint8_t GetIntegrationRule(void);
+
+// Returns true if the gravity-referenced attitude filter is enabled
+bool IsAttitudeFilterEnabled(void);
+
+// Returns true if the attitude and gyro bias Kalman filter is enabled
+bool IsEKFEnabled(void);
+
+// Returns true if the derived attitude representations are computed every output period
+bool IsAttitudeSubscribed(void);
+
+// Returns the pending calibration upload command
+uint8_t GetCalCommand(void);
+
+// Returns the pending alignment command
+uint8_t GetAlignCommand(void);
+
+// Returns the first sensor of the calibration upload
+uint8_t GetCalSensor(void);
+
+// Returns the number of sensors in the calibration upload
+uint8_t GetCalCount(void);
+
+// Returns the CRC-32 of the uploaded calibration coefficients, as sent by the master
+uint32_t GetCalCRC(void);
+
+// Returns the method used to fuse the data of all sensors
+uint8_t GetFusionMode(void);
+
+// Returns the number of sensors (in 32nds of the enabled sensors) discarded from each
+// end by the trimmed mean
+uint8_t GetFusionTrim(void);
+
 // Returns true if the SD overwrite flag is set to true
 bool GetSDFileOverwrite(void);
 
+// Returns true if the gyro bias is estimated during static intervals
+bool IsBiasEstimationEnabled(void);
+
+// Returns true if the low-power group calibration is selected (sensor data is summed
+// within each mounting group and only the group sums are calibrated)
+bool IsGroupCalibrationEnabled(void);
+
 // Returns true if the data acquisition is enabled
 bool IsDAQEnabled(void);
 
@@ -214,6 +450,12 @@ bool IsSDDataRequested(void);
 // **********************************************************************
 
 
+// Clears the calibration upload command once it has been handled
+void ClearCalCommand(void);
+
+// Clears the alignment command once it has been handled
+void ClearAlignCommand(void);
+
 // Clears the end of file flag
 void ClearSDEOFFlag(void);
 
@@ -226,6 +468,15 @@ void ClearRegisterUpdateFlag(void);
 // Raises the SD end of file flag
 void RaiseSDEOFFlag(void);
 
+// Sets the calibration upload status
+void SetCalStatus(uint8_t status);
+
+// Sets the alignment status
+void SetAlignStatus(uint8_t status);
+
+// Sets (if 'value' is true) or clears the bits in 'mask' of the status register
+void SetStatusFlag(uint8_t mask, bool value);
+
 // Writes the 32-bit floating point to the block of registers [addr : addr + 3]
 // If write will modify memory outside register address range, no write occurs
 void RegWriteFloat32(uint8_t addr, float val);
@@ -238,6 +489,22 @@ void RegWriteUInt32(uint8_t addr, uint32_t val);
 // If write will modify memory outside register address range, no write occurs
 void RegWriteUInt8(uint8_t addr, uint8_t val);
 
+// Returns the output buffer that is published by the next call to RegPublishOutput. It
+// holds the previous output of the processing, not the last published one.
+struct OutputRegisters* RegOutputBuffer(void);
+
+// Makes the output registers written since the last call visible to the master and
+// increments REG_OUT_SEQ. Read transactions that have already started keep reading the
+// previous output.
+void RegPublishOutput(void);
+
+// Returns true once the master has selected PAGE_FIFO, before that no records are queued
+bool RegFifoEnabled(void);
+
+// Adds the output 'record' to the output record FIFO and numbers it. Returns false if the
+// FIFO was full.
+bool RegPushRecord(const struct OutputRegisters *record);
+
 
 // **********************************************************************
 // ************* Interrupt Methods **************************************
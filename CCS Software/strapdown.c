@@ -0,0 +1,191 @@
+/*
+ * strapdown.c
+ *
+ *  Description: Strapdown inertial navigation kernels. Turns the angle and velocity
+ *               increments of the averaged sensor data into attitude and velocity
+ *               updates.
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "main.h"
+#include "registers.h"
+#include "strapdown.h"
+#include "vector3.h"
+
+// Weights of the newest to the oldest sample for each integration rule (INTEGRATION_*).
+// Each rule integrates a polynomial through the last few samples over the newest sample
+// interval only (Adams-Moulton), so an increment is produced on every sample. The Simpson
+// entry is exact for polynomials up to degree 2 and the Boole entry up to degree 4, one
+// less than Simpson's and Boole's rules over their full span (3 and 5).
+static const float ruleWeights[3][INTEGRATION_MAX_POINTS] = {
+	{1.0f/2, 1.0f/2, 0, 0, 0},
+	{5.0f/12, 8.0f/12, -1.0f/12, 0, 0},
+	{251.0f/720, 646.0f/720, -264.0f/720, 106.0f/720, -19.0f/720}
+};
+static const uint8_t rulePoints[3] = {2, 3, 5};
+
+uint8_t IntegrationRulePoints(uint8_t rule) {
+	return rulePoints[rule];
+}
+
+void IntegrateSamples(uint8_t rule, float *const *samples, float dt, float *dV, float *dTheta) {
+
+	uint8_t i, p = 0;
+
+	for(i = 0; i < 3; i++) {
+		dV[i] = 0;
+		dTheta[i] = 0;
+	}
+	for(p = 0; p < rulePoints[rule]; p++) {
+		const float *w = samples[p];
+		float k = dt*ruleWeights[rule][p];
+		for(i = 0; i < 3; i++) {
+			dV[i] += k*w[AX + i];
+			dTheta[i] += k*w[GX + i];
+		}
+	}
+}
+
+void ConingSculling(float dThetaInc[][3], float dVInc[][3], uint8_t n, float *dTheta, float *dV) {
+
+	// Ignagni's N-sample coning algorithms (see Savage, "Strapdown Inertial Navigation
+	// Integration Algorithm Design", Part 1). Each term is a pair of increments (i, j)
+	// with coefficient k. By the coning/sculling equivalence, the sculling correction
+	// uses the same terms with (dTheta_i x dV_j + dV_i x dTheta_j).
+	static const struct ConingTerm coning2[] = {
+		{0, 1, 2.0f/3.0f}
+	};
+	static const struct ConingTerm coning3[] = {
+		{0, 2, 9.0f/20.0f}, {1, 2, 27.0f/40.0f}, {0, 1, 27.0f/40.0f}
+	};
+	static const struct ConingTerm coning4[] = {
+		{0, 1, 214.0f/315.0f}, {1, 2, 214.0f/315.0f}, {2, 3, 214.0f/315.0f},
+		{0, 2, 46.0f/105.0f}, {1, 3, 46.0f/105.0f}, {0, 3, 54.0f/105.0f}
+	};
+	const struct ConingTerm *terms = 0;
+	uint8_t numTerms = 0;
+	uint8_t i = 0;
+
+	switch(n) {
+		case 2: terms = coning2; numTerms = 1; break;
+		case 3: terms = coning3; numTerms = 3; break;
+		case 4: terms = coning4; numTerms = 6; break;
+		default: break;
+	}
+
+	// Sum of the angle and velocity increments over the update interval
+	float alpha[3] = {0}, nu[3] = {0};
+	for(i = 0; i < n; i++) {
+		alpha[X] += dThetaInc[i][X];
+		alpha[Y] += dThetaInc[i][Y];
+		alpha[Z] += dThetaInc[i][Z];
+		nu[X] += dVInc[i][X];
+		nu[Y] += dVInc[i][Y];
+		nu[Z] += dVInc[i][Z];
+	}
+
+	// Rotation vector: sum plus coning compensation
+	// Velocity increment in the body frame at the start of the interval: sum plus the
+	// rotation compensation (1/2 alpha x nu) and the sculling compensation
+	dTheta[X] = alpha[X];
+	dTheta[Y] = alpha[Y];
+	dTheta[Z] = alpha[Z];
+	dV[X] = nu[X];
+	dV[Y] = nu[Y];
+	dV[Z] = nu[Z];
+	VectorCrossMultAdd(dV, alpha, nu, 0.5f);
+
+	for(i = 0; i < numTerms; i++) {
+		const struct ConingTerm *t = &terms[i];
+		VectorCrossMultAdd(dTheta, dThetaInc[t->i], dThetaInc[t->j], t->k);
+		VectorCrossMultAdd(dV, dThetaInc[t->i], dVInc[t->j], t->k);
+		VectorCrossMultAdd(dV, dVInc[t->i], dThetaInc[t->j], t->k);
+	}
+}
+
+// Computes the body to navigation frame rotation matrix 'C' (row-major) of the attitude
+// quaternion 'qa' (scalar first)
+void ComputeRotationMatrix(const float *qa, float *C) {
+	C[0] = 1 - 2*(qa[2]*qa[2] + qa[3]*qa[3]);
+	C[1] = 2*(qa[1]*qa[2] - qa[0]*qa[3]);
+	C[2] = 2*(qa[1]*qa[3] + qa[0]*qa[2]);
+	C[3] = 2*(qa[1]*qa[2] + qa[0]*qa[3]);
+	C[4] = 1 - 2*(qa[1]*qa[1] + qa[3]*qa[3]);
+	C[5] = 2*(qa[2]*qa[3] - qa[0]*qa[1]);
+	C[6] = 2*(qa[1]*qa[3] - qa[0]*qa[2]);
+	C[7] = 2*(qa[2]*qa[3] + qa[0]*qa[1]);
+	C[8] = 1 - 2*(qa[1]*qa[1] + qa[2]*qa[2]);
+}
+
+void RotateVector(const float *C, const float *v, float *r) {
+	r[X] = C[0]*v[X] + C[1]*v[Y] + C[2]*v[Z];
+	r[Y] = C[3]*v[X] + C[4]*v[Y] + C[5]*v[Z];
+	r[Z] = C[6]*v[X] + C[7]*v[Y] + C[8]*v[Z];
+}
+
+float PropagateQuaternion(float *q, const float *dTheta, uint16_t interval, uint16_t *renormCount) {
+	float q1[4] = {1,0,0,0};	// Delta theta represented as quaternion
+	float qProp[4] = {0};		// Propagated attitude quaternion
+
+	// Compute norm of delta theta
+	float phi_sq = dTheta[X]*dTheta[X] + dTheta[Y]*dTheta[Y] + dTheta[Z]*dTheta[Z];
+
+	// Convert to quaternion representation. A rotation too small to matter leaves the
+	// delta quaternion at identity.
+	if(phi_sq > 1E-12f) {
+	    // Approximate cosine by Taylor series up to 2nd order terms
+		q1[0] = 1 - 0.125f*phi_sq;
+
+	    // Approximate sine by Taylor series up to 2nd order terms
+		float a = 0.5f - phi_sq*(1.0f/48.0f);
+		q1[1] = dTheta[X]*a;
+		q1[2] = dTheta[Y]*a;
+		q1[3] = dTheta[Z]*a;
+	}
+
+	// Propagate the attitude quaternion
+	qProp[0] = q[0]*q1[0] - q[1]*q1[1] - q[2]*q1[2] - q[3]*q1[3];
+	qProp[1] = q[0]*q1[1] + q[1]*q1[0] + q[2]*q1[3] - q[3]*q1[2];
+	qProp[2] = q[0]*q1[2] - q[1]*q1[3] + q[2]*q1[0] + q[3]*q1[1];
+	qProp[3] = q[0]*q1[3] + q[1]*q1[2] - q[2]*q1[1] + q[3]*q1[0];
+
+	// Normalize the quaternion. Each update only moves the norm slightly away from one, so
+	// the first-order correction (3 - |q|^2)/2 is enough most of the time. An exact
+	// normalization is done every so often to remove the remaining drift.
+	float qNormSq = qProp[0]*qProp[0] + qProp[1]*qProp[1] + qProp[2]*qProp[2] + qProp[3]*qProp[3];
+	float normError = fabsf(qNormSq - 1);
+	float k = 0;
+	if((++*renormCount >= interval) || (normError > QUAT_NORM_TOL)) {
+		k = 1 / sqrtf(qNormSq);
+		*renormCount = 0;
+	}
+	else {
+		k = 0.5f*(3 - qNormSq);
+	}
+	q[0] = qProp[0]*k;
+	q[1] = qProp[1]*k;
+	q[2] = qProp[2]*k;
+	q[3] = qProp[3]*k;
+
+	return normError;
+}
+
+void CompensatedAdd(struct CompensatedSum *s, float x) {
+	float t = s->sum + x;
+
+	// Recover the rounding error of the addition from whichever operand is larger
+	if(fabsf(s->sum) >= fabsf(x)) {
+		s->c += (s->sum - t) + x;
+	}
+	else {
+		s->c += (x - t) + s->sum;
+	}
+	s->sum = t;
+}
+
+float CompensatedValue(const struct CompensatedSum *s) {
+	return s->sum + s->c;
+}
@@ -0,0 +1,64 @@
+/*
+ * strapdown.h
+ *
+ *  Description: Strapdown inertial navigation kernels. Turns the angle and velocity
+ *               increments of the averaged sensor data into attitude and velocity
+ *               updates. Relies on main.h for the axis indices.
+ */
+
+#ifndef STRAPDOWN_H_
+#define STRAPDOWN_H_
+
+// Most samples any integration rule (INTEGRATION_* in registers.h) fits its polynomial
+// through
+#define INTEGRATION_MAX_POINTS      (5)
+
+// Coning/sculling compensation term: k * (increment i x increment j)
+struct ConingTerm {
+	uint8_t i;
+	uint8_t j;
+	float k;
+};
+
+// Running sum with a compensation term that collects the low-order bits lost when a small
+// increment is added to a large sum (Neumaier's variant of Kahan summation). The value of
+// the sum is 'sum + c'.
+struct CompensatedSum {
+	float sum;
+	float c;
+};
+
+// Returns the number of samples integration rule 'rule' needs
+uint8_t IntegrationRulePoints(uint8_t rule);
+
+// Integrates the averaged samples over the newest sample interval 'dt' with integration
+// rule 'rule' into the velocity increment 'dV' and the angle increment 'dTheta'.
+// 'samples[p]' is the sample taken 'p' samples before the newest one.
+void IntegrateSamples(uint8_t rule, float *const *samples, float dt, float *dV, float *dTheta);
+
+// Combines the 'n' angle increments 'dThetaInc' and velocity increments 'dVInc' of an
+// update interval into the rotation vector 'dTheta' and the velocity increment 'dV' (body
+// frame at the start of the interval), with the n-sample coning and sculling compensation
+// for n = 2 to 4. Any other 'n' only sums the increments.
+void ConingSculling(float dThetaInc[][3], float dVInc[][3], uint8_t n, float *dTheta, float *dV);
+
+// Rotates the attitude quaternion 'q' (scalar first) by the rotation vector 'dTheta' and
+// renormalizes it. The exact normalization is done once every 'interval' updates (counted
+// in 'renormCount') or when the norm is off by more than QUAT_NORM_TOL, the first-order
+// correction otherwise. Returns the size of the norm error |q|^2 - 1 before normalizing.
+float PropagateQuaternion(float *q, const float *dTheta, uint16_t interval, uint16_t *renormCount);
+
+// Computes the body to navigation frame rotation matrix 'C' (row-major) of the attitude
+// quaternion 'qa' (scalar first)
+void ComputeRotationMatrix(const float *qa, float *C);
+
+// Rotates the vector 'v' by the rotation matrix 'C' (row-major) into 'r'
+void RotateVector(const float *C, const float *v, float *r);
+
+// Adds 'x' to the compensated sum 's'
+void CompensatedAdd(struct CompensatedSum *s, float x);
+
+// Returns the value of the compensated sum 's'
+float CompensatedValue(const struct CompensatedSum *s);
+
+#endif /* STRAPDOWN_H_ */
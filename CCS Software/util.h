@@ -13,6 +13,10 @@
 // Comment out to disable debug mode (i.e. no output to UART)
 #define DEBUG_MODE
 
+// Uncomment to also run every batch through the old two-stage calibrate-then-average path
+// and report its cost in the processing statistics (for comparison only, costs CPU time)
+//#define PROFILE_TWO_STAGE_CAL
+
 // Returns 1 if the bit at 'pos' is 1. Otherwise, returns 0
 #define CHECK_BIT(var,pos) (var & (1 << pos))
 // Sets the bit at 'pos' to 1
@@ -20,4 +24,20 @@
 // Clears the bit at 'pos' to 0
 #define CLEAR_BIT(var,pos) (var &= ~(1 << pos))
 
+// Cortex-M4 debug registers for the free-running CPU cycle counter (DWT CYCCNT)
+#define DEMCR                       (*((volatile uint32_t *)0xE000EDFC))
+#define DEMCR_TRCENA                (0x01000000)
+#define DWT_CTRL                    (*((volatile uint32_t *)0xE0001000))
+#define DWT_CTRL_CYCCNTENA          (0x00000001)
+#define DWT_CYCCNT                  (*((volatile uint32_t *)0xE0001004))
+
+// Starts the CPU cycle counter
+#define CYCLE_COUNTER_ENABLE() { DEMCR |= DEMCR_TRCENA; DWT_CYCCNT = 0; DWT_CTRL |= DWT_CTRL_CYCCNTENA; }
+// Returns the current value of the CPU cycle counter. Differences between two values give
+// elapsed cycles, even if the counter wrapped in between.
+#define CYCLE_COUNT() (DWT_CYCCNT)
+
+// Fails to compile if 'cond' is false. 'name' must be unique in the file.
+#define STATIC_CHECK(cond, name) typedef char static_check_##name[(cond) ? 1 : -1]
+
 #endif /* UTIL_H_ */
@@ -32,3 +32,9 @@ void VectorCrossMult(float **result, float *a, float *b) {
 	*result = retVal;
 	return;
 }
+
+void VectorCrossMultAdd(float *result, const float *a, const float *b, float c) {
+	result[0] += c*(a[1]*b[2] - a[2]*b[1]);
+	result[1] += c*(a[2]*b[0] - a[0]*b[2]);
+	result[2] += c*(a[0]*b[1] - a[1]*b[0]);
+}
@@ -20,5 +20,8 @@ void VectorMult(float **result, float *a, float c);
 // The cross product of 'a' and 'b' is returned in 'result'
 void VectorCrossMult(float **result, float *a, float *b);
 
+// The cross product of 'a' and 'b', scaled by 'c', is added to 'result'
+void VectorCrossMultAdd(float *result, const float *a, const float *b, float c);
+
 
 #endif /* VECTOR3_H_ */
@@ -0,0 +1,156 @@
+function [errAcc,errGyro] = CompareGroupCalibration(dataRaw,coeffs,groupSize,plotOn)
+% COMPAREGROUPCALIBRATION - Measures the accuracy lost by the group
+% calibration mode compared to calibrating every sensor.
+%
+% Replays logged raw data through both calibrations of the firmware and
+% compares the fused (mean) outputs:
+%   - Per-sensor: each sensor is calibrated with its own coefficients and
+%     the calibrated values are averaged (CalibrateAndAverageData)
+%   - Group: the raw counts of each group of sensors are averaged first
+%     and calibrated once with the averaged coefficients of the group
+%     (ComputeGroupCoefficients, CalibrateGroupSums)
+%
+% Arguments
+% ---------------------------------
+% dataRaw - Raw data structure returned by ParseBinaryData (.AX ... .GZ,
+%           .Temp, one column per sensor)
+% coeffs - Struct array with the calibration coefficients of each sensor,
+%          as in struct CalibrationCoefficients of the firmware:
+%   .b - Bias (1x6, AX AY AZ GX GY GZ)
+%   .S - Scale factor (1x6)
+%   .M - Misalignment (1x6)
+%   .T - Temperature coefficient (1x6)
+%   .G - Gyro g-sensitivity (1x9)
+%   .TB - (Optional) Temperature bias table (6x22, Q4 raw counts)
+%   .TS - (Optional) Temperature scale table (6x22, Q15)
+% groupSize - Number of sensors per mounting group (8 on the IMU board)
+% plotOn - If plotOn = 1, plots the difference over time
+%
+% Both calibrations use the temperature of every sample, the firmware
+% only updates the temperature compensation every REG_TEMP_CAL_DIV samples
+% in either mode.
+%
+% Returns
+% ----------------------------------
+% errAcc - Group minus per-sensor specific force (m/s^2), one row per sample
+% errGyro - Group minus per-sensor angular rate (rad/s), one row per sample
+
+% Conversion factors of the firmware (main.h)
+K_A = 0.000061035;
+K_G = 0.007633587;
+K_T = 0.003059976;
+DEG_TO_RAD = 0.0174533;
+GRAVITY = 9.81;
+% Temperature of the table entries in raw counts (TEMP_LUT_MIN, TEMP_LUT_SHIFT)
+tableTemp = -21504 + (0:21)*2048;
+
+raw = cat(3,dataRaw.AX,dataRaw.AY,dataRaw.AZ,dataRaw.GX,dataRaw.GY,dataRaw.GZ);
+temp = dataRaw.Temp;
+numSamples = size(raw,1);
+numSensors = size(raw,2);
+numGroups = numSensors/groupSize;
+
+% Averaged coefficients of each group
+groupCoeffs = coeffs(1:numGroups);
+for g = 1 : numGroups
+    s = (g-1)*groupSize + (1:groupSize);
+    groupCoeffs(g).b = mean(vertcat(coeffs(s).b),1);
+    groupCoeffs(g).S = mean(vertcat(coeffs(s).S),1);
+    groupCoeffs(g).M = mean(vertcat(coeffs(s).M),1);
+    groupCoeffs(g).T = mean(vertcat(coeffs(s).T),1);
+    groupCoeffs(g).G = mean(vertcat(coeffs(s).G),1);
+    if(isfield(coeffs,'TB'))
+        groupCoeffs(g).TB = fix(mean(cat(3,coeffs(s).TB),3));
+        groupCoeffs(g).TS = fix(mean(cat(3,coeffs(s).TS),3));
+    end
+end
+
+sensorSum = zeros(numSamples,6);
+groupSum = zeros(numSamples,6);
+
+display('Calibrating...');
+tic;
+% Calibrate every sensor
+for s = 1 : numSensors
+    sensorSum = sensorSum + Calibrate(squeeze(raw(:,s,:)),temp(:,s),coeffs(s));
+end
+% Calibrate the averaged raw counts of every group, weighted by its size
+for g = 1 : numGroups
+    s = (g-1)*groupSize + (1:groupSize);
+    groupSum = groupSum + groupSize*Calibrate(squeeze(mean(raw(:,s,:),2)),...
+        mean(temp(:,s),2),groupCoeffs(g));
+end
+toc;
+
+err = (groupSum - sensorSum)/numSensors;
+errAcc = GRAVITY*err(:,1:3);
+errGyro = DEG_TO_RAD*err(:,4:6);
+
+axisNames = {'X','Y','Z'};
+fprintf('Group vs. per-sensor calibration over %d samples\n',numSamples);
+for i = 1 : 3
+    fprintf('  A%s: RMS %.3e m/s^2, max %.3e m/s^2\n',axisNames{i},...
+        sqrt(mean(errAcc(:,i).^2)),max(abs(errAcc(:,i))));
+end
+for i = 1 : 3
+    fprintf('  G%s: RMS %.3e rad/s, max %.3e rad/s\n',axisNames{i},...
+        sqrt(mean(errGyro(:,i).^2)),max(abs(errGyro(:,i))));
+end
+
+if(plotOn == 1)
+    t = dataRaw.t;
+    figure;
+    subplot(2,1,1);
+    plot(t,errAcc);
+    title('Group - Per-Sensor Specific Force'); xlabel('Time (s)'); ylabel('m/s^2');
+    legend('X','Y','Z');
+    subplot(2,1,2);
+    plot(t,errGyro);
+    title('Group - Per-Sensor Angular Rate'); xlabel('Time (s)'); ylabel('rad/s');
+    legend('X','Y','Z');
+end
+
+    % Calibrates the raw counts 'r' (samples x 6) at raw temperature 'tRaw'
+    % with the coefficients 'c', as the calibration loop of the firmware.
+    % Returns g's and deg/s.
+    function out = Calibrate(r,tRaw,c)
+        k = [K_A K_A K_A K_G K_G K_G];
+        dT = K_T*tRaw;
+        sc = repmat(k,size(r,1),1);
+        off = repmat(c.b,size(r,1),1) + dT*c.T;
+        if(isfield(c,'TB'))
+            x = min(max(tRaw,tableTemp(1)),tableTemp(end));
+            for j = 1 : 6
+                sc(:,j) = k(j)*(1 + interp1(tableTemp,double(c.TS(j,:)),x)/32768);
+                off(:,j) = off(:,j) + k(j)*interp1(tableTemp,double(c.TB(j,:)),x)/16;
+            end
+        end
+        [A_ISM,G_ISM] = InverseScaleMisalignment(c.S,c.M);
+        G = reshape(c.G,3,3)';
+
+        a = (sc(:,1:3).*r(:,1:3) - off(:,1:3))*A_ISM';
+        w = (sc(:,4:6).*r(:,4:6) - off(:,4:6) - a*G')*G_ISM';
+        out = [a w];
+    end
+end
+
+function [A_ISM,G_ISM] = InverseScaleMisalignment(S,M)
+% Inverse misalignment/scale factor matrices, as in ComputeCalibrationTable
+A_ISM = Inverse(S(1:3),M(1:3));
+G_ISM = Inverse(S(4:6),M(4:6));
+end
+
+function I = Inverse(S,M)
+den = S(1) + S(2) + S(3) + S(1)*S(2) + S(1)*S(3) + S(2)*S(3) + ...
+    M(2)^2*S(2) + M(3)^2*S(1) + M(1)^2*S(3) + M(1)^2 + M(2)^2 + M(3)^2 + ...
+    S(1)*S(2)*S(3) + 1;
+I = [ (M(3)^2 + S(2) + S(3) + S(2)*S(3) + 1), ...
+     -(M(1) + M(1)*S(3) + M(2)*M(3)), ...
+     -(M(2) + M(2)*S(2) - M(1)*M(3)); ...
+      (M(1) + M(1)*S(3) - M(2)*M(3)), ...
+      (M(2)^2 + S(1) + S(3) + S(1)*S(3) + 1), ...
+     -(M(3) + M(3)*S(1) + M(1)*M(2)); ...
+      (M(2) + M(2)*S(2) + M(1)*M(3)), ...
+      (M(3) + M(3)*S(1) - M(1)*M(2)), ...
+      (M(1)^2 + S(1) + S(2) + S(1)*S(2) + 1)]/den;
+end
@@ -52,7 +52,7 @@ tickCount = 0; % Tick count in the data
 err = 0;
 
 dataRawParsed = zeros(packetCount,225);
-dataCalParsed = zeros(packetCount,15);
+dataCalParsed = zeros(packetCount,21);
 
 % Loop through each packet
 tic;
@@ -91,6 +91,18 @@ for i = 1 : packetCount-1
         % Copy calibrated data
         dataCalParsed(calCount,2:15) = typecast(uint8(dataRow), 'single');
         calCount = calCount + 1;
+
+    % NAVIGATION DATA PACKET
+    elseif(length(encData) == 26)
+        % Decode the data
+        [dataRow,errCobs] = cobs_decode(encData);
+        err = err + errCobs;
+        % This packet comes right after the calibrated data packet of the
+        % same record
+        if(calCount > 1)
+            % Copy velocity and position
+            dataCalParsed(calCount-1,16:21) = typecast(uint8(dataRow), 'single');
+        end
        
     else
         err = err + 1;
@@ -117,7 +129,9 @@ dataCal = struct('t',T*dataCalParsed(:,1),...   % Time vector
     'DV',dataCalParsed(:,5:7),...               % Latest delta V
     'Q',dataCalParsed(:,8:11),...               % Attitude quaternion
     'Temp',dataCalParsed(:,12),...              % Avg. temperature
-    'AccumV',dataCalParsed(:,13:15));           % Accumulated velocity
+    'AccumV',dataCalParsed(:,13:15),...         % Accumulated velocity
+    'Vel',dataCalParsed(:,16:18),...            % Navigation frame velocity
+    'Pos',dataCalParsed(:,19:21));              % Navigation frame position
 
 % Plot raw data
 if(plotOn == 1)
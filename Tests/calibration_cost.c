@@ -0,0 +1,181 @@
+/*
+ * calibration_cost.c
+ *
+ *  Description: Host test of the fused calibration loop (CalibrateAndAverageData in
+ *               calibration.c) against the old two-stage path (CalibrateData followed by
+ *               AverageData, built with PROFILE_TWO_STAGE_CAL). Both run on the same queued
+ *               records and coefficients for several sets of enabled sensors. The averaged
+ *               data of every record must agree to rounding, and the cost of each path per
+ *               record is reported.
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "imu.h"
+#include "main.h"
+#include "calibration.h"
+
+// Calls of each path for the cost, per batch size
+#define TIMED_CALLS                 (200000)
+
+// Queue and fusion weights of main.c
+volatile struct RawDataQueue queue[QUEUE_SIZE];
+float fusionWeight[NUM_IMU_VALUES][NUM_SENSORS];
+
+// IMU enable vector of imu.c
+static uint32_t imuEnable = 0xFFFFFFFF;
+
+uint32_t GetIMUEnableVector(void) {
+	return imuEnable;
+}
+
+bool IsIMUEnabled(uint8_t i) {
+	return (imuEnable >> i) & 0x01;
+}
+
+// No gyro bias estimate (main.c)
+float GetGyroBiasCorrection(uint8_t axis, uint8_t i) {
+	return 0;
+}
+
+// Fixed LCG so runs repeat
+static uint32_t seed = 12345;
+
+static float Random(float amp) {
+	seed = seed*1664525u + 1013904223u;
+	return ((float)(seed >> 8)/(1 << 24) - 0.5f)*2*amp;
+}
+
+// Coefficients in the range of a calibrated sensor: small bias and temperature terms,
+// scale factor/misalignment matrices close to identity
+static void LoadCoefficients(void) {
+	uint8_t i, j;
+
+	for(i = 0; i < NUM_SENSORS; i++) {
+		for(j = 0; j < NUM_IMU_VALUES; j++) {
+			tempComp.scale[j][i] = ((j < GX) ? K_A : K_G)*(1 + Random(0.01f));
+			tempComp.offset[j][i] = (j < GX) ? Random(0.05f) : Random(2.0f);
+			fusionWeight[j][i] = 1;
+		}
+		for(j = 0; j < 9; j++) {
+			float diag = (j % 4 == 0) ? 1 : 0;
+			calTable->A_ISM[j][i] = diag + Random(0.01f);
+			calTable->G_ISM[j][i] = diag + Random(0.01f);
+			calTable->G[j][i] = Random(0.05f);
+		}
+	}
+}
+
+static void LoadQueue(void) {
+	uint16_t r;
+	uint8_t i;
+
+	for(r = 0; r < QUEUE_SIZE; r++) {
+		queue[r].timeStamp = r;
+		for(i = 0; i < NUM_SENSORS; i++) {
+			// About 1 g on Z, rates up to 100 deg/s, around 30 deg C
+			queue[r].sensor[i].data[AX] = (int16_t)Random(2000);
+			queue[r].sensor[i].data[AY] = (int16_t)Random(2000);
+			queue[r].sensor[i].data[AZ] = (int16_t)(16384 + Random(2000));
+			queue[r].sensor[i].data[GX] = (int16_t)Random(13000);
+			queue[r].sensor[i].data[GY] = (int16_t)Random(13000);
+			queue[r].sensor[i].data[GZ] = (int16_t)Random(13000);
+			queue[r].sensor[i].data[TEMP] = (int16_t)(1634 + Random(100));
+		}
+	}
+}
+
+// Largest difference between the fused and two-stage results over every record of every
+// batch in the queue, relative to the size of the value (absolute near zero)
+static double CompareBatches(uint16_t n) {
+	uint16_t k, j;
+	uint8_t a;
+	double maxError = 0;
+
+	for(k = 0; k < QUEUE_SIZE; k += n) {
+		CalibrateAndAverageData(k, n, false, false);
+		CalibrateData(k, n);
+		AverageData(n);
+
+		for(j = 0; j < n; j++) {
+			for(a = 0; a < NUM_IMU_VALUES; a++) {
+				double d = fabs(dataFused[j][a] - dataTwoStage[j][a]) /
+						fmax(fabs(dataTwoStage[j][a]), 1.0);
+				if(d > maxError) {
+					maxError = d;
+				}
+			}
+			double d = fabs(tempFused[j] - tempTwoStage[j]) / fabs(tempTwoStage[j]);
+			if(d > maxError) {
+				maxError = d;
+			}
+		}
+	}
+	return maxError;
+}
+
+// Host time (ns) per record of each path for batches of 'n' records
+static void MeasureCost(uint16_t n, double *nsFused, double *nsTwoStage) {
+	uint32_t c;
+	uint16_t k = 0;
+	clock_t start = clock();
+
+	for(c = 0; c < TIMED_CALLS; c++) {
+		CalibrateAndAverageData(k, n, false, false);
+		k = (k + n) % QUEUE_SIZE;
+	}
+	*nsFused = 1e9*(double)(clock() - start)/CLOCKS_PER_SEC / TIMED_CALLS / n;
+
+	k = 0;
+	start = clock();
+	for(c = 0; c < TIMED_CALLS; c++) {
+		CalibrateData(k, n);
+		AverageData(n);
+		k = (k + n) % QUEUE_SIZE;
+	}
+	*nsTwoStage = 1e9*(double)(clock() - start)/CLOCKS_PER_SEC / TIMED_CALLS / n;
+}
+
+int main(void) {
+
+	static const uint32_t enables[] = {0xFFFFFFFF, 0x55555555, 0x7FFFFFFE, 0x00000001};
+	static const uint16_t batches[] = {1, CAL_BATCH_SIZE};
+	uint8_t e, b;
+	int failures = 0;
+
+	LoadCoefficients();
+	LoadQueue();
+
+	printf("Fused vs. two-stage calibration, %d sensors, %d record queue\n", NUM_SENSORS,
+			QUEUE_SIZE);
+	printf("%10s %6s %14s %14s %14s\n", "enabled", "batch", "max rel. diff",
+			"fused (ns)", "2-stage (ns)");
+	for(e = 0; e < sizeof(enables)/sizeof(enables[0]); e++) {
+		imuEnable = enables[e];
+		for(b = 0; b < sizeof(batches)/sizeof(batches[0]); b++) {
+			double nsFused = 0, nsTwoStage = 0;
+			double maxError = CompareBatches(batches[b]);
+			// Both paths round differently (one scale per record vs. per sensor), the
+			// results must still agree to a few float ulps of the summed values
+			int ok = (maxError < 1E-5);
+			// Only time the all-sensor case, the others follow the sensor count
+			if(e == 0) {
+				MeasureCost(batches[b], &nsFused, &nsTwoStage);
+				printf("0x%08X %6u %14.3e %14.1f %14.1f %s\n", enables[e], batches[b],
+						maxError, nsFused, nsTwoStage, ok ? "" : "FAIL");
+			}
+			else {
+				printf("0x%08X %6u %14.3e %14s %14s %s\n", enables[e], batches[b],
+						maxError, "-", "-", ok ? "" : "FAIL");
+			}
+			failures += !ok;
+		}
+	}
+
+	printf("%s\n", failures ? "FAILED" : "PASSED");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,99 @@
+/*
+ * compensated_sum.c
+ *
+ *  Description: Long-run benchmark of the velocity accumulation of main.c. Sums the
+ *               velocity increments of a long run in single precision, naively and with
+ *               the Neumaier summation of CompensatedAdd (strapdown.c), and reports the
+ *               error growth of both against a double precision sum and their cost.
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "main.h"
+#include "strapdown.h"
+
+#define Ts                          (1.0f/SAMPLE_RATE)
+
+// Simulated run (h)
+#define DURATION_HOURS              (8)
+// Increments summed for the cost of each summation, in passes over TIMED_BLOCK samples
+#define TIMED_BLOCK                 (4096)
+#define TIMED_PASSES                (20000)
+
+// Velocity increment (m/s) of sample 'n': a constant residual acceleration, as from an
+// uncompensated bias, plus a vibration that averages out. Fixed LCG noise so runs repeat.
+static float Increment(uint32_t n, uint32_t *seed) {
+	*seed = *seed*1664525u + 1013904223u;
+	float noise = ((float)(*seed >> 8)/(1 << 24) - 0.5f)*0.02f;
+	return Ts*(0.0123f + 0.5f*sinf(0.37f*n) + noise);
+}
+
+int main(void) {
+
+	uint32_t seed = 12345;
+	uint32_t n = 0, samples = (uint32_t)DURATION_HOURS*3600*SAMPLE_RATE;
+	float naive = 0;
+	struct CompensatedSum comp = {0};
+	double ref = 0;
+	// Report times (s)
+	static const uint32_t reports[] = {60, 600, 3600, DURATION_HOURS*3600};
+	uint8_t r = 0;
+	int failures = 0;
+
+	printf("Velocity accumulation error at %d Hz (m/s, vs. double)\n", SAMPLE_RATE);
+	printf("%10s %12s %12s %12s\n", "time (s)", "velocity", "naive", "Neumaier");
+	for(n = 0; n < samples; n++) {
+		float x = Increment(n, &seed);
+		naive += x;
+		CompensatedAdd(&comp, x);
+		ref += x;
+
+		if(n + 1 == reports[r]*SAMPLE_RATE) {
+			double errNaive = fabs(naive - ref);
+			double errComp = fabs(CompensatedValue(&comp) - ref);
+			// The compensated sum must stay at the rounding of its value, one float ulp
+			int ok = (errComp <= ldexp(fabs(ref), -23));
+			printf("%10u %12.4f %12.3e %12.3e %s\n", (n + 1)/SAMPLE_RATE, ref, errNaive,
+					errComp, ok ? "" : "FAIL");
+			failures += !ok;
+			r++;
+		}
+	}
+
+	// Cost of each addition, over the same increments
+	static float block[TIMED_BLOCK];
+	uint32_t p = 0;
+	for(n = 0; n < TIMED_BLOCK; n++) {
+		block[n] = Increment(n, &seed);
+	}
+
+	clock_t start = clock();
+	naive = 0;
+	for(p = 0; p < TIMED_PASSES; p++) {
+		for(n = 0; n < TIMED_BLOCK; n++) {
+			naive += block[n];
+		}
+	}
+	double nsNaive = 1e9*(double)(clock() - start)/CLOCKS_PER_SEC / TIMED_PASSES / TIMED_BLOCK;
+
+	start = clock();
+	comp.sum = comp.c = 0;
+	for(p = 0; p < TIMED_PASSES; p++) {
+		for(n = 0; n < TIMED_BLOCK; n++) {
+			CompensatedAdd(&comp, block[n]);
+		}
+	}
+	double nsComp = 1e9*(double)(clock() - start)/CLOCKS_PER_SEC / TIMED_PASSES / TIMED_BLOCK;
+	// Keep the sums alive
+	volatile float sink = naive + CompensatedValue(&comp);
+	(void)sink;
+
+	printf("Cost per addition (host): naive %.2f ns, Neumaier %.2f ns\n", nsNaive, nsComp);
+
+	printf("%s\n", failures ? "FAILED" : "PASSED");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,380 @@
+/*
+ * coning_sculling.c
+ *
+ *  Description: Host test of the N-sample coning and sculling compensation
+ *               (ConingSculling in strapdown.c). The increments of classical coning and
+ *               sculling motion are fed to the algorithm and the drift of the computed
+ *               rotation and velocity vectors is compared to the analytic drift of each
+ *               algorithm, down to the resolution of the single precision kernel. The
+ *               velocity increments of a tilted sculling motion are also rotated into the
+ *               navigation frame as in IntegrateAccelerometerData (main.c) and the drift
+ *               of the navigation velocity is checked. Also reports the cost of each N.
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "main.h"
+#include "strapdown.h"
+
+#define Ts                          (1.0/SAMPLE_RATE)
+
+#define PI                          (3.14159265358979323846)
+
+// Coning motion: half-cone angle and coning frequency. The algorithms only cancel the
+// terms of second order in the cone angle, the angle is kept small so the fourth order
+// terms stay below the 4-sample drift.
+#define CONE_ANGLE                  (1E-4)			// rad
+#define CONE_FREQ                   (6.0)			// Hz
+// Sculling motion: angular oscillation about X in phase with an acceleration along Y,
+// same frequency as the coning motion
+#define SCULL_ANGLE                 (1E-4)			// rad
+#define SCULL_ACC                   (1.0)			// m/s^2
+// Updates simulated for each N
+#define UPDATES                     (20000)
+// Resolution of the measured drift with the single precision kernel, a few float ulps of
+// the summed increments per update. The 4-sample drift of this motion is below it, the
+// kernel itself then only has to stay within it.
+#define CONING_RESOLUTION           (5E-14)			// rad/s
+#define SCULLING_RESOLUTION         (5E-13)			// m/s^2
+// Navigation frame velocity: the sculling motion with a larger angle, so its drift stands
+// out of the rounding of the rotated increments, on a body tilted by NAV_TILT about the
+// axis (1, 2, 3). The single precision rotation and the third order terms of the motion
+// limit the resolution, the 3 and 4-sample drifts are below it.
+#define NAV_ANGLE                   (1E-2)			// rad
+#define NAV_TILT                    (0.5)			// rad
+#define NAV_RESOLUTION              (1.5E-8)		// m/s^2
+// Calls timed for the cost of each N
+#define TIMED_CALLS                 (2000000)
+
+// Cross products of the compensation terms of each n (n = 1 is the uncompensated sum)
+static const uint8_t numTerms[5] = {0, 0, 1, 3, 6};
+
+// Tilt of the body in the navigation frame test, as a quaternion (scalar first) and a
+// rotation matrix (row-major). Set in main.
+static double navTilt[4];
+static double navC0[9];
+
+// Attitude (body to navigation quaternion, scalar first) of classical coning motion:
+// q = [cos(a/2), 0, sin(a/2)*cos(wt), sin(a/2)*sin(wt)]
+static void ConingAttitude(double t, double *q) {
+	double w = 2*PI*CONE_FREQ;
+	q[0] = cos(CONE_ANGLE/2);
+	q[1] = 0;
+	q[2] = sin(CONE_ANGLE/2)*cos(w*t);
+	q[3] = sin(CONE_ANGLE/2)*sin(w*t);
+}
+
+// Exact integral over [t0, t1] of the body rate of the coning motion,
+// w = [-2*W*sin(a/2)^2, -W*sin(a)*sin(Wt), W*sin(a)*cos(Wt)]
+static void ConingIncrement(double t0, double t1, double *dTheta) {
+	double w = 2*PI*CONE_FREQ;
+	double s = sin(CONE_ANGLE/2);
+	dTheta[0] = -2*w*s*s*(t1 - t0);
+	dTheta[1] = sin(CONE_ANGLE)*(cos(w*t1) - cos(w*t0));
+	dTheta[2] = sin(CONE_ANGLE)*(sin(w*t1) - sin(w*t0));
+}
+
+// Rotation vector of the rotation from attitude 'q0' to attitude 'q1'
+static void RelativeRotation(const double *q0, const double *q1, double *phi) {
+	// r = conj(q0) * q1
+	double r0 = q0[0]*q1[0] + q0[1]*q1[1] + q0[2]*q1[2] + q0[3]*q1[3];
+	double r1 = q0[0]*q1[1] - q0[1]*q1[0] - q0[2]*q1[3] + q0[3]*q1[2];
+	double r2 = q0[0]*q1[2] + q0[1]*q1[3] - q0[2]*q1[0] - q0[3]*q1[1];
+	double r3 = q0[0]*q1[3] - q0[1]*q1[2] + q0[2]*q1[1] - q0[3]*q1[0];
+	double v = sqrt(r1*r1 + r2*r2 + r3*r3);
+	double k = (v > 0) ? 2*atan2(v, r0)/v : 2;
+	phi[0] = r1*k;
+	phi[1] = r2*k;
+	phi[2] = r3*k;
+}
+
+// Analytic drift (rad/s, about X) of the n-sample algorithm under coning motion, to
+// leading order: -a^2*W*(W*T)^(2n)/D with T = n*Ts the update interval (Ignagni, "Efficient
+// Class of Optimized Coning Compensation Algorithms", 1996). n = 1 is the plain sum.
+static double AnalyticDrift(uint8_t n) {
+	static const double D[5] = {0, 12, 960, 204120, 82575360};
+	double w = 2*PI*CONE_FREQ;
+	return -CONE_ANGLE*CONE_ANGLE*w*pow(w*n*Ts, 2*n) / D[n];
+}
+
+// Average drift (rad/s, about X) of the n-sample algorithm over UPDATES updates
+static double MeasureDrift(uint8_t n) {
+	float dThetaInc[4][3], dVInc[4][3] = {{0}};
+	float dTheta[3], dV[3];
+	double phi[3], q0[4], q1[4];
+	double sum = 0;
+	uint32_t u = 0;
+	uint8_t i = 0;
+
+	for(u = 0; u < UPDATES; u++) {
+		double t = u*n*Ts;
+		for(i = 0; i < n; i++) {
+			double inc[3];
+			ConingIncrement(t + i*Ts, t + (i + 1)*Ts, inc);
+			dThetaInc[i][0] = inc[0];
+			dThetaInc[i][1] = inc[1];
+			dThetaInc[i][2] = inc[2];
+		}
+		ConingSculling(dThetaInc, dVInc, n, dTheta, dV);
+
+		ConingAttitude(t, q0);
+		ConingAttitude(t + n*Ts, q1);
+		RelativeRotation(q0, q1, phi);
+		sum += dTheta[0] - phi[0];
+	}
+	return sum / (UPDATES*n*Ts);
+}
+
+// Angle about X of the sculling motion of amplitude 'p', phi = p*sin(wt)
+static double ScullingAngle(double p, double t) {
+	return p*sin(2*PI*CONE_FREQ*t);
+}
+
+// Exact increments over [t0, t1] of the sculling motion: body rate about X and specific
+// force f = [0, A*sin(wt), 0]
+static void ScullingIncrement(double p, double t0, double t1, double *dTheta, double *dV) {
+	double w = 2*PI*CONE_FREQ;
+	dTheta[0] = ScullingAngle(p, t1) - ScullingAngle(p, t0);
+	dTheta[1] = 0;
+	dTheta[2] = 0;
+	dV[0] = 0;
+	dV[1] = SCULL_ACC*(cos(w*t0) - cos(w*t1))/w;
+	dV[2] = 0;
+}
+
+// Velocity change over [t0, t1] in the body frame at t0 (Z component, where the sculling
+// error rectifies): integral of sin(phi(t) - phi(t0))*A*sin(wt), by Simpson's rule
+#define SCULL_STEPS                 (200)
+static double ScullingReference(double t0, double t1) {
+	double w = 2*PI*CONE_FREQ;
+	double h = (t1 - t0)/SCULL_STEPS;
+	double sum = 0;
+	uint16_t s = 0;
+	for(s = 0; s <= SCULL_STEPS; s++) {
+		double t = t0 + s*h;
+		double f = sin(ScullingAngle(SCULL_ANGLE, t) - ScullingAngle(SCULL_ANGLE, t0))*
+				SCULL_ACC*sin(w*t);
+		sum += ((s == 0) || (s == SCULL_STEPS)) ? f : ((s & 1) ? 4*f : 2*f);
+	}
+	return sum*h/3;
+}
+
+// Analytic sculling drift (m/s^2, along Z) of the n-sample algorithm for a sculling
+// angle 'p'. By the coning/sculling equivalence it is the coning drift with the rectified
+// rate a^2*W/2 replaced by the rectified acceleration p*A/2.
+static double AnalyticScullingDrift(double p, uint8_t n) {
+	static const double D[5] = {0, 12, 960, 204120, 82575360};
+	double w = 2*PI*CONE_FREQ;
+	return -p*SCULL_ACC*pow(w*n*Ts, 2*n) / D[n];
+}
+
+// Average sculling drift (m/s^2, along Z) of the n-sample algorithm over UPDATES updates
+static double MeasureScullingDrift(uint8_t n) {
+	float dThetaInc[4][3], dVInc[4][3];
+	float dTheta[3], dV[3];
+	double sum = 0;
+	uint32_t u = 0;
+	uint8_t i = 0, a = 0;
+
+	for(u = 0; u < UPDATES; u++) {
+		double t = u*n*Ts;
+		for(i = 0; i < n; i++) {
+			double incTheta[3], incV[3];
+			ScullingIncrement(SCULL_ANGLE, t + i*Ts, t + (i + 1)*Ts, incTheta, incV);
+			for(a = 0; a < 3; a++) {
+				dThetaInc[i][a] = incTheta[a];
+				dVInc[i][a] = incV[a];
+			}
+		}
+		ConingSculling(dThetaInc, dVInc, n, dTheta, dV);
+		sum += dV[2] - ScullingReference(t, t + n*Ts);
+	}
+	return sum / (UPDATES*n*Ts);
+}
+
+// Attitude (body to navigation quaternion, scalar first) of the sculling motion of
+// amplitude NAV_ANGLE on a body tilted by q0: q = q0 * [cos(phi/2), sin(phi/2), 0, 0]
+static void NavAttitude(double t, double *q) {
+	double h = ScullingAngle(NAV_ANGLE, t)/2;
+	double c = cos(h), s = sin(h);
+	q[0] = navTilt[0]*c - navTilt[1]*s;
+	q[1] = navTilt[1]*c + navTilt[0]*s;
+	q[2] = navTilt[2]*c + navTilt[3]*s;
+	q[3] = navTilt[3]*c - navTilt[2]*s;
+}
+
+// Exact velocity change over [t0, t1] in the navigation frame: C0 times the integral of
+// [0, A*sin(wt)*cos(phi), A*sin(wt)*sin(phi)], by Simpson's rule
+static void NavReference(double t0, double t1, double *dv) {
+	double w = 2*PI*CONE_FREQ;
+	double h = (t1 - t0)/SCULL_STEPS;
+	double y = 0, z = 0;
+	uint16_t s = 0;
+	for(s = 0; s <= SCULL_STEPS; s++) {
+		double t = t0 + s*h;
+		double phi = ScullingAngle(NAV_ANGLE, t);
+		double k = ((s == 0) || (s == SCULL_STEPS)) ? 1 : ((s & 1) ? 4 : 2);
+		y += k*SCULL_ACC*sin(w*t)*cos(phi);
+		z += k*SCULL_ACC*sin(w*t)*sin(phi);
+	}
+	y *= h/3;
+	z *= h/3;
+	dv[0] = navC0[1]*y + navC0[2]*z;
+	dv[1] = navC0[4]*y + navC0[5]*z;
+	dv[2] = navC0[7]*y + navC0[8]*z;
+}
+
+// Average drift (m/s^2) of the navigation frame velocity of the n-sample algorithm over
+// UPDATES updates. As in IntegrateAccelerometerData, the body frame velocity increment
+// is rotated by the attitude at the start of each update interval.
+static void MeasureNavDrift(uint8_t n, double *drift) {
+	float dThetaInc[4][3], dVInc[4][3];
+	float dTheta[3], dV[3], dVNav[3], q[4], C[9];
+	double qd[4], ref[3];
+	double sum[3] = {0};
+	uint32_t u = 0;
+	uint8_t i = 0, a = 0;
+
+	for(u = 0; u < UPDATES; u++) {
+		double t = u*n*Ts;
+		for(i = 0; i < n; i++) {
+			double incTheta[3], incV[3];
+			ScullingIncrement(NAV_ANGLE, t + i*Ts, t + (i + 1)*Ts, incTheta, incV);
+			for(a = 0; a < 3; a++) {
+				dThetaInc[i][a] = incTheta[a];
+				dVInc[i][a] = incV[a];
+			}
+		}
+		ConingSculling(dThetaInc, dVInc, n, dTheta, dV);
+
+		NavAttitude(t, qd);
+		for(a = 0; a < 4; a++) {
+			q[a] = qd[a];
+		}
+		ComputeRotationMatrix(q, C);
+		RotateVector(C, dV, dVNav);
+
+		NavReference(t, t + n*Ts, ref);
+		for(a = 0; a < 3; a++) {
+			sum[a] += dVNav[a] - ref[a];
+		}
+	}
+	for(a = 0; a < 3; a++) {
+		drift[a] = sum[a] / (UPDATES*n*Ts);
+	}
+}
+
+// Host time (ns) of one update of the n-sample algorithm in single precision
+static double MeasureCost(uint8_t n) {
+	static float dThetaInc[4][3] = {{1e-3f, 2e-3f, 3e-3f}, {2e-3f, 1e-3f, 3e-3f},
+			{3e-3f, 2e-3f, 1e-3f}, {1e-3f, 3e-3f, 2e-3f}};
+	static float dVInc[4][3] = {{1e-2f, 2e-2f, 3e-2f}, {2e-2f, 1e-2f, 3e-2f},
+			{3e-2f, 2e-2f, 1e-2f}, {1e-2f, 3e-2f, 2e-2f}};
+	volatile float sink = 0;
+	float dTheta[3], dV[3];
+	uint32_t c = 0;
+
+	clock_t start = clock();
+	for(c = 0; c < TIMED_CALLS; c++) {
+		dThetaInc[0][0] = sink;
+		ConingSculling(dThetaInc, dVInc, n, dTheta, dV);
+		sink = dTheta[0]*1e-30f + dV[0]*1e-30f;
+	}
+	return 1e9*(double)(clock() - start)/CLOCKS_PER_SEC / TIMED_CALLS;
+}
+
+int main(void) {
+
+	uint8_t n = 0;
+	int failures = 0;
+
+	printf("Coning drift, cone angle %.1e rad at %.1f Hz, %d Hz sampling\n", CONE_ANGLE,
+			CONE_FREQ, SAMPLE_RATE);
+	printf("%2s %14s %14s %7s %6s %10s %10s\n", "N", "drift (rad/s)", "analytic",
+			"ratio", "cross", "ns/update", "ns/sample");
+	for(n = 1; n <= 4; n++) {
+		double drift = MeasureDrift(n);
+		double analytic = AnalyticDrift(n);
+		double cost = MeasureCost(n);
+
+		// Terms beyond the leading order are a few percent at this coning frequency
+		int ok = (fabs(drift - analytic) <= 0.05*fabs(analytic) + CONING_RESOLUTION);
+		// Each algorithm must also drift less than the one before
+		static double lastDrift = 0;
+		if((n > 1) && (fabs(drift) >= fabs(lastDrift)) && (fabs(drift) > CONING_RESOLUTION)) {
+			ok = 0;
+		}
+		lastDrift = drift;
+
+		printf("%2u %14.4e %14.4e %7.4f %6u %10.1f %10.1f %s\n", n, drift, analytic,
+				drift / analytic, 3*numTerms[n] + 1, cost, cost / n, ok ? "" : "FAIL");
+		failures += !ok;
+	}
+	printf("(cross: cross products per update, N = 1 is the uncompensated sum)\n\n");
+
+	printf("Sculling drift, angle %.1e rad, acceleration %.1f m/s^2 at %.1f Hz\n",
+			SCULL_ANGLE, SCULL_ACC, CONE_FREQ);
+	printf("%2s %14s %14s %7s\n", "N", "drift (m/s^2)", "analytic", "ratio");
+	for(n = 1; n <= 4; n++) {
+		double drift = MeasureScullingDrift(n);
+		double analytic = AnalyticScullingDrift(SCULL_ANGLE, n);
+
+		int ok = (fabs(drift - analytic) <= 0.05*fabs(analytic) + SCULLING_RESOLUTION);
+		static double lastDrift = 0;
+		if((n > 1) && (fabs(drift) >= fabs(lastDrift)) && (fabs(drift) > SCULLING_RESOLUTION)) {
+			ok = 0;
+		}
+		lastDrift = drift;
+
+		printf("%2u %14.4e %14.4e %7.4f %s\n", n, drift, analytic, drift / analytic,
+				ok ? "" : "FAIL");
+		failures += !ok;
+	}
+
+	printf("\nNavigation frame velocity drift, angle %.1e rad on a body tilted by %.1f rad\n",
+			NAV_ANGLE, NAV_TILT);
+	printf("%2s %14s %14s %14s %14s\n", "N", "X (m/s^2)", "Y (m/s^2)", "Z (m/s^2)",
+			"|error|");
+	double axis = sqrt(14.0);
+	navTilt[0] = cos(NAV_TILT/2);
+	navTilt[1] = sin(NAV_TILT/2)*1/axis;
+	navTilt[2] = sin(NAV_TILT/2)*2/axis;
+	navTilt[3] = sin(NAV_TILT/2)*3/axis;
+	navC0[0] = 1 - 2*(navTilt[2]*navTilt[2] + navTilt[3]*navTilt[3]);
+	navC0[1] = 2*(navTilt[1]*navTilt[2] - navTilt[0]*navTilt[3]);
+	navC0[2] = 2*(navTilt[1]*navTilt[3] + navTilt[0]*navTilt[2]);
+	navC0[3] = 2*(navTilt[1]*navTilt[2] + navTilt[0]*navTilt[3]);
+	navC0[4] = 1 - 2*(navTilt[1]*navTilt[1] + navTilt[3]*navTilt[3]);
+	navC0[5] = 2*(navTilt[2]*navTilt[3] - navTilt[0]*navTilt[1]);
+	navC0[6] = 2*(navTilt[1]*navTilt[3] - navTilt[0]*navTilt[2]);
+	navC0[7] = 2*(navTilt[2]*navTilt[3] + navTilt[0]*navTilt[1]);
+	navC0[8] = 1 - 2*(navTilt[1]*navTilt[1] + navTilt[2]*navTilt[2]);
+	for(n = 1; n <= 4; n++) {
+		double drift[3], expected[3], err = 0, size = 0;
+		uint8_t a = 0;
+		MeasureNavDrift(n, drift);
+
+		// The sculling drift along body Z, rotated into the navigation frame
+		double analytic = AnalyticScullingDrift(NAV_ANGLE, n);
+		for(a = 0; a < 3; a++) {
+			expected[a] = navC0[3*a + 2]*analytic;
+			err += (drift[a] - expected[a])*(drift[a] - expected[a]);
+			size += expected[a]*expected[a];
+		}
+		err = sqrt(err);
+		int ok = (err <= 0.05*sqrt(size) + NAV_RESOLUTION);
+
+		printf("%2u %14.4e %14.4e %14.4e %14.4e %s\n", n, drift[0], drift[1], drift[2], err,
+				ok ? "" : "FAIL");
+		printf("%2s %14.4e %14.4e %14.4e (expected)\n", "", expected[0], expected[1],
+				expected[2]);
+		failures += !ok;
+	}
+
+	printf("%s\n", failures ? "FAILED" : "PASSED");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,104 @@
+/*
+ * integration_rules.c
+ *
+ *  Description: Host test of the integration rules of ComputeIncrements (IntegrateSamples
+ *               in strapdown.c). A sinusoidal angular rate is sampled at the IMU rate,
+ *               integrated with each rule and compared to the exact angle. Reports the angle error of each rule
+ *               and checks its order of convergence.
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "main.h"
+#include "registers.h"
+#include "strapdown.h"
+
+#define PI                          (3.14159265358979323846)
+
+// Angular rate w = RATE_AMP*sin(2*pi*f*t) + RATE_AMP/2
+#define RATE_AMP                    (1.0)			// rad/s
+// Simulated time for each case
+#define DURATION                    (10.0)			// s
+
+// Global order of each rule (local error of order + 1)
+static const uint8_t ruleOrder[3] = {2, 3, 5};
+static const char *ruleNames[3] = {"Trapezoid", "Simpson", "Boole"};
+
+static double Rate(double t, double f) {
+	return RATE_AMP*sin(2*PI*f*t) + RATE_AMP/2;
+}
+
+static double Angle(double t, double f) {
+	return RATE_AMP*(1 - cos(2*PI*f*t))/(2*PI*f) + RATE_AMP/2*t;
+}
+
+// Largest error (rad) of the accumulated angle over DURATION, for a rate of frequency
+// 'f' (Hz) sampled at 'rate' (Hz). The samples before t = 0 are taken as available, as
+// after the first few samples on the target.
+static double MaxAngleError(uint8_t rule, double f, double rate) {
+	double ts = 1.0/rate;
+	uint32_t samples = (uint32_t)(DURATION*rate + 0.5);
+	uint32_t s = 0;
+	uint8_t p = 0;
+	double angle = 0, maxErr = 0;
+	float data[INTEGRATION_MAX_POINTS][NUM_IMU_VALUES] = {{0}};
+	float *window[INTEGRATION_MAX_POINTS];
+	float dV[3], dTheta[3];
+
+	for(p = 0; p < INTEGRATION_MAX_POINTS; p++) {
+		window[p] = data[p];
+	}
+	for(s = 1; s <= samples; s++) {
+		// Newest to oldest sample of the rate about X
+		for(p = 0; p < IntegrationRulePoints(rule); p++) {
+			data[p][GX] = Rate(((double)s - p)*ts, f);
+		}
+		IntegrateSamples(rule, window, ts, dV, dTheta);
+		angle += dTheta[X];
+		double err = fabs(angle - Angle(s*ts, f));
+		if(err > maxErr) {
+			maxErr = err;
+		}
+	}
+	return maxErr;
+}
+
+int main(void) {
+
+	static const double freqs[] = {0.5, 2, 5, 10};
+	uint8_t rule = 0, i = 0;
+	int failures = 0;
+
+	printf("Largest angle error (rad) over %.0f s, rate amplitude %.1f rad/s, %d Hz sampling\n",
+			DURATION, RATE_AMP, SAMPLE_RATE);
+	printf("%-10s", "Rule");
+	for(i = 0; i < sizeof(freqs)/sizeof(freqs[0]); i++) {
+		printf(" %8.1f Hz", freqs[i]);
+	}
+	printf(" %8s %8s\n", "order", "expected");
+
+	for(rule = INTEGRATION_TRAPEZOID; rule <= INTEGRATION_BOOLE; rule++) {
+		printf("%-10s", ruleNames[rule]);
+		for(i = 0; i < sizeof(freqs)/sizeof(freqs[0]); i++) {
+			printf(" %11.3e", MaxAngleError(rule, freqs[i], SAMPLE_RATE));
+		}
+
+		// Order of convergence from the error at the 10 Hz rate sampled at 100 and 200 Hz
+		double order = log2(MaxAngleError(rule, 10, SAMPLE_RATE/2) /
+				MaxAngleError(rule, 10, SAMPLE_RATE));
+		int ok = (fabs(order - ruleOrder[rule]) < 0.3);
+		// Each rule must also be more accurate than the one before
+		if((rule > INTEGRATION_TRAPEZOID) &&
+				(MaxAngleError(rule, 10, SAMPLE_RATE) >= MaxAngleError(rule - 1, 10, SAMPLE_RATE))) {
+			ok = 0;
+		}
+		printf(" %8.2f %8u %s\n", order, ruleOrder[rule], ok ? "" : "FAIL");
+		failures += !ok;
+	}
+
+	printf("%s\n", failures ? "FAILED" : "PASSED");
+	return failures ? 1 : 0;
+}
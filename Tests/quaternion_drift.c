@@ -0,0 +1,140 @@
+/*
+ * quaternion_drift.c
+ *
+ *  Description: Long run of the attitude quaternion update of IntegrateGyroData
+ *               (PropagateQuaternion in strapdown.c). Propagates the quaternion in single
+ *               precision with the first-order norm correction and an exact normalization
+ *               every QUAT_RENORM_INTERVAL updates, and compares the norm and attitude
+ *               drift to other renormalization intervals and to a double precision
+ *               reference.
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "main.h"
+#include "strapdown.h"
+
+#define Ts                          (1.0/SAMPLE_RATE)
+
+// Simulated time (s)
+#define DURATION                    (3600)
+// Interval meaning the exact normalization is only done when the norm is off by more
+// than QUAT_NORM_TOL
+#define NEVER                       (0xFFFF)
+
+// Body angular rate (rad/s), slowly varying so every axis is exercised
+static void Rate(double t, double *w) {
+	w[0] = 0.5*sin(0.05*t) + 0.1;
+	w[1] = 0.3*cos(0.03*t);
+	w[2] = 0.2*sin(0.07*t + 1);
+}
+
+// Reference update in double precision, normalized exactly every update
+static void UpdateReference(double *q, const double *dTheta) {
+	double q1[4] = {1, 0, 0, 0}, qProp[4];
+	double phi_sq = dTheta[0]*dTheta[0] + dTheta[1]*dTheta[1] + dTheta[2]*dTheta[2];
+	double phi = sqrt(phi_sq);
+	if(phi > 0) {
+		q1[0] = cos(phi/2);
+		q1[1] = dTheta[0]*sin(phi/2)/phi;
+		q1[2] = dTheta[1]*sin(phi/2)/phi;
+		q1[3] = dTheta[2]*sin(phi/2)/phi;
+	}
+	qProp[0] = q[0]*q1[0] - q[1]*q1[1] - q[2]*q1[2] - q[3]*q1[3];
+	qProp[1] = q[0]*q1[1] + q[1]*q1[0] + q[2]*q1[3] - q[3]*q1[2];
+	qProp[2] = q[0]*q1[2] - q[1]*q1[3] + q[2]*q1[0] + q[3]*q1[1];
+	qProp[3] = q[0]*q1[3] + q[1]*q1[2] - q[2]*q1[1] + q[3]*q1[0];
+	double k = 1 / sqrt(qProp[0]*qProp[0] + qProp[1]*qProp[1] + qProp[2]*qProp[2] +
+			qProp[3]*qProp[3]);
+	q[0] = qProp[0]*k;
+	q[1] = qProp[1]*k;
+	q[2] = qProp[2]*k;
+	q[3] = qProp[3]*k;
+}
+
+// Angle (rad) of the rotation between the float attitude 'qf' and the reference 'qd'
+static double AttitudeError(const float *qf, const double *qd) {
+	double d = qf[0]*qd[0] + qf[1]*qd[1] + qf[2]*qd[2] + qf[3]*qd[3];
+	double n = sqrt((double)qf[0]*qf[0] + (double)qf[1]*qf[1] + (double)qf[2]*qf[2] +
+			(double)qf[3]*qf[3]);
+	d = fabs(d)/n;
+	return (d >= 1) ? 0 : 2*acos(d);
+}
+
+int main(void) {
+
+	static const uint16_t intervals[] = {1, 10, QUAT_RENORM_INTERVAL, 1000, NEVER};
+	const uint8_t numIntervals = sizeof(intervals)/sizeof(intervals[0]);
+	float qf[5][4];
+	uint16_t renormCount[5] = {0};
+	uint32_t exactCount[5] = {0};
+	double maxNormError[5] = {0}, maxAttError[5] = {0};
+	double qd[4] = {1, 0, 0, 0};
+	uint32_t u = 0, updates = DURATION*SAMPLE_RATE;
+	uint8_t i = 0;
+	int failures = 0;
+
+	for(i = 0; i < numIntervals; i++) {
+		qf[i][0] = 1;
+		qf[i][1] = qf[i][2] = qf[i][3] = 0;
+	}
+
+	for(u = 0; u < updates; u++) {
+		double w[3];
+		double dThetaD[3];
+		float dThetaF[3];
+		Rate((u + 0.5)*Ts, w);
+		for(i = 0; i < 3; i++) {
+			dThetaD[i] = w[i]*Ts;
+			dThetaF[i] = (float)dThetaD[i];
+		}
+
+		UpdateReference(qd, dThetaD);
+		for(i = 0; i < numIntervals; i++) {
+			float *q = qf[i];
+			PropagateQuaternion(q, dThetaF, intervals[i], &renormCount[i]);
+			// The count restarts on every exact normalization
+			if(renormCount[i] == 0) {
+				exactCount[i]++;
+			}
+			double normError = fabs(q[0]*q[0] + q[1]*q[1] + q[2]*q[2] + q[3]*q[3] - 1.0);
+			double attError = AttitudeError(q, qd);
+			if(normError > maxNormError[i]) {
+				maxNormError[i] = normError;
+			}
+			if(attError > maxAttError[i]) {
+				maxAttError[i] = attError;
+			}
+		}
+	}
+
+	printf("Quaternion drift over %d s at %d Hz\n", DURATION, SAMPLE_RATE);
+	printf("%9s %14s %16s %14s\n", "interval", "max |q|^2 - 1", "max error (rad)",
+			"exact/update");
+	for(i = 0; i < numIntervals; i++) {
+		int ok = 1;
+		// The norm must stay within the tolerance the update enforces
+		if(maxNormError[i] > 2*QUAT_NORM_TOL) {
+			ok = 0;
+		}
+		// The default interval must keep the attitude as well as normalizing every update
+		if((intervals[i] == QUAT_RENORM_INTERVAL) && (maxAttError[i] > 2*maxAttError[0])) {
+			ok = 0;
+		}
+		if(intervals[i] == NEVER) {
+			printf("%9s", "tol only");
+		}
+		else {
+			printf("%9u", intervals[i]);
+		}
+		printf(" %14.3e %16.3e %14.4f %s\n", maxNormError[i], maxAttError[i],
+				(double)exactCount[i] / updates, ok ? "" : "FAIL");
+		failures += !ok;
+	}
+
+	printf("%s\n", failures ? "FAILED" : "PASSED");
+	return failures ? 1 : 0;
+}
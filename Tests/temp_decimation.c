@@ -0,0 +1,126 @@
+/*
+ * temp_decimation.c
+ *
+ *  Description: Host test of the error bound of the decimated temperature compensation
+ *               (UpdateDecimatedTemperatureCompensation in calibration.c). A sensor follows
+ *               a temperature ramp through CalibrateAndAverageData, which averages its raw
+ *               readings over each update period, and the compensation is recomputed from
+ *               the average once the temperature moved by TEMP_COMP_HYSTERESIS. The
+ *               temperature the compensation was computed for must stay within
+ *               1.5*R*P + 0.049 deg C of the actual one.
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "imu.h"
+#include "main.h"
+#include "calibration.h"
+
+// Seconds simulated for each case, shortened so the ramp stays within the operating range
+#define DURATION                    (600)
+#define RAMP_SPAN                   (100)		// deg C
+// Linear temperature coefficient of the simulated sensor ((deg/s)/deg C)
+#define TEMP_COEFF                  (0.01f)
+
+// Queue and fusion weights of main.c
+volatile struct RawDataQueue queue[QUEUE_SIZE];
+float fusionWeight[NUM_IMU_VALUES][NUM_SENSORS];
+
+// Only the first sensor is simulated
+uint32_t GetIMUEnableVector(void) {
+	return 0x00000001;
+}
+
+bool IsIMUEnabled(uint8_t i) {
+	return i == 0;
+}
+
+// No gyro bias estimate
+float GetGyroBiasCorrection(uint8_t axis, uint8_t i) {
+	return 0;
+}
+
+// Runs a temperature ramp of 'rate' deg C/s starting at 'start' deg C through the
+// calibration and the decimated update with divider 'div'. Returns the largest error of
+// the compensation temperature (deg C) and the number of updates in 'updates'.
+static float RunRamp(float start, float rate, uint8_t div, uint32_t *updates) {
+
+	float maxError = 0;
+	uint32_t k = 0;
+	uint16_t r = 0;
+	float duration = DURATION;
+	if(rate*duration > RAMP_SPAN) {
+		duration = RAMP_SPAN / rate;
+	}
+
+	// Only a linear temperature coefficient on the gyro X axis, so the offset is
+	// TEMP_COEFF times the temperature (from 25 deg C) it was computed for. The
+	// compensation starts at 25 deg C, as at power-up.
+	memset(ccBank, 0, sizeof(ccBank));
+	memset(calTables, 0, sizeof(calTables));
+	memset(&tempComp, 0, sizeof(tempComp));
+	calTable->T[GX][0] = TEMP_COEFF;
+	UpdateTemperatureCompensation(0, 0);
+
+	*updates = 0;
+	for(k = 0; k < duration*SAMPLE_RATE; k++) {
+		float t = (float)k / SAMPLE_RATE;
+		float actual = start + rate*t;
+		queue[r].sensor[0].data[TEMP] = (int16_t)lrintf((actual - 25) / K_T);
+
+		// Calibration of this sample uses the current compensation. Skip the first
+		// two periods, before the first average is in.
+		if(k >= 2u*div) {
+			float error = fabsf(actual - 25 - tempComp.offset[GX][0] / TEMP_COEFF);
+			if(error > maxError) {
+				maxError = error;
+			}
+		}
+
+		// Same sequence as ProcessDataRecords, one record at a time
+		int16_t before = tempComp.temp[0];
+		CalibrateAndAverageData(r, 1, false, false);
+		tempComp.samples++;
+		if(tempComp.samples >= div) {
+			UpdateDecimatedTemperatureCompensation();
+			if(tempComp.temp[0] != before) {
+				(*updates)++;
+			}
+		}
+		if(++r >= QUEUE_SIZE) {
+			r = 0;
+		}
+	}
+	return maxError;
+}
+
+int main(void) {
+
+	static const uint8_t divs[] = {1, 10, 50, 100, 200, 255};
+	static const float rates[] = {0, 0.01f, 0.1f, 1.0f};
+	uint8_t d, r = 0;
+	int failures = 0;
+
+	printf("Decimated temperature compensation error (from -20 deg C, up to %d s)\n", DURATION);
+	printf("%5s %9s %12s %12s %9s\n", "div", "R (C/s)", "max err (C)", "bound (C)", "updates");
+	for(d = 0; d < sizeof(divs); d++) {
+		for(r = 0; r < sizeof(rates)/sizeof(rates[0]); r++) {
+			uint32_t updates = 0;
+			float P = (float)divs[d] / SAMPLE_RATE;
+			float error = RunRamp(-20, rates[r], divs[d], &updates);
+			// One more sample of lag for the average and one raw count of rounding
+			float bound = 1.5f*rates[r]*(P + 1.0f/SAMPLE_RATE) + TEMP_COMP_HYSTERESIS*K_T + K_T;
+			int ok = (error <= bound);
+			printf("%5u %9.2f %12.4f %12.4f %9lu %s\n", divs[d], rates[r], error, bound,
+					(unsigned long)updates, ok ? "" : "FAIL");
+			failures += !ok;
+		}
+	}
+
+	printf("%s\n", failures ? "FAILED" : "PASSED");
+	return failures ? 1 : 0;
+}